@@ -0,0 +1,272 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "batch.h"
+#include "save.h"
+#include "tiled.h"
+#include "util/error.h"
+#include "util/mem.h"
+#include "util/time.h"
+#include "util/wand.h"
+
+// One "src dst WxH+X+Y" manifest line
+struct mu_batch_item {
+	char *src;
+	char *dst;
+	size_t x;
+	size_t y;
+	size_t width;
+	size_t height;
+};
+
+struct mu_batch_pool {
+	pthread_mutex_t lock;
+	struct mu_batch_item *items;
+	size_t nitems;
+	size_t next;
+	size_t failed;
+	bool jpeg_snap;
+};
+
+struct mu_batch_thread {
+	pthread_t thread;
+	struct mu_batch_pool *pool;
+	struct mu_error *errlist;
+	bool started;
+};
+
+static void free_items(struct mu_batch_item *items, size_t nitems)
+{
+	for (size_t i = 0; i < nitems; i++) {
+		free(items[i].src);
+		free(items[i].dst);
+	}
+	free(items);
+}
+
+static int read_manifest(struct mu_error **err, const char *manifest, struct mu_batch_item **items, size_t *nitems)
+{
+	FILE *fp = stdin;
+	char *line = NULL;
+	size_t cap = 0, size = 0, alloc = 0, lineno = 0;
+	struct mu_batch_item *list = NULL;
+	ssize_t len;
+
+	if (strcmp(manifest, "-") != 0) {
+		fp = fopen(manifest, "r");
+		if (fp == NULL)
+			MU_RET_ERRNO(err, errno);
+	}
+
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		struct mu_batch_item item = {};
+		char src[4096], dst[4096];
+		int n;
+
+		lineno++;
+		if (len <= 1 || line[0] == '#')
+			continue;
+
+		n = sscanf(line, "%4095s %4095s %zux%zu+%zu+%zu", src, dst, &item.width, &item.height, &item.x, &item.y);
+		if (n != 6 || item.width == 0 || item.height == 0) {
+			MU_PUSH_ERRF(err, "%s:%zu: expected \"src dst WxH+X+Y\"", manifest, lineno);
+			goto fail;
+		}
+
+		if (size == alloc) {
+			struct mu_batch_item *tmp = realloc_array(list, alloc ? alloc * 2 : 64, sizeof(item));
+			if (tmp == NULL) {
+				MU_PUSH_ERRNO(err, ENOMEM);
+				goto fail;
+			}
+			list = tmp;
+			alloc = alloc ? alloc * 2 : 64;
+		}
+		item.src = strdup(src);
+		item.dst = strdup(dst);
+		list[size++] = item;
+		if (item.src == NULL || item.dst == NULL) {
+			MU_PUSH_ERRNO(err, ENOMEM);
+			goto fail;
+		}
+	}
+
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+
+	*items = list;
+	*nitems = size;
+
+	return 0;
+
+fail:
+	free(line);
+	free_items(list, size);
+	if (fp != stdin)
+		fclose(fp);
+	return -1;
+}
+
+/*
+ * Pings the source to pick the same path an interactive save of a master that
+ * was never decoded takes: lossless JPEG, a tiled TIFF read, frames, or an
+ * extract read of the crop alone.
+ */
+static int write_item(struct mu_error **err, MagickWand *wand, struct mu_batch_item *item, const char *dst,
+		bool jpeg_snap)
+{
+	struct mu_save save = {
+		.src_filename = item->src,
+		.master = wand,
+		.read = true,
+		.crop = true,
+		.x = item->x,
+		.y = item->y,
+		.width = item->width,
+		.height = item->height,
+		.jpeg_snap = jpeg_snap,
+		// The other workers keep the cores busy
+		.nthreads = 1,
+	};
+	size_t width, height;
+
+	ClearMagickWand(wand);
+	if (MagickPingImage(wand, item->src) == MagickFalse) {
+		RaiseWandException(wand, err);
+		return -1;
+	}
+	save.nframes = MagickGetNumberImages(wand);
+	MagickResetIterator(wand);
+	width  = MagickGetImageWidth(wand);
+	height = MagickGetImageHeight(wand);
+	save.tiled = width * height > MU_TILED_AREA && is_tiff_file(item->src);
+	ClearMagickWand(wand);
+
+	return write_crop(err, &save, dst);
+}
+
+// Writes through a synced temporary file, so a failed crop never truncates dst, which may be src
+static int crop_item(struct mu_error **err, MagickWand *wand, struct mu_batch_item *item, bool jpeg_snap)
+{
+	char *tmp;
+	int fd, ret;
+
+	fd = open_temp(err, item->dst, &tmp);
+	if (fd < 0)
+		return -1;
+
+	ret = write_item(err, wand, item, tmp, jpeg_snap);
+	if (ret == 0)
+		ret = commit_temp(err, fd, tmp, item->dst);
+	close(fd);
+	if (ret != 0)
+		unlink(tmp);
+	free(tmp);
+
+	return ret;
+}
+
+static void *batch_main(void *data)
+{
+	struct mu_batch_thread *self = data;
+	struct mu_batch_pool *pool = self->pool;
+	MagickWand *wand = NewMagickWand();
+
+	for (;;) {
+		struct mu_batch_item *item;
+
+		pthread_mutex_lock(&pool->lock);
+		item = pool->next < pool->nitems ? &pool->items[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+		if (item == NULL)
+			break;
+
+		if (crop_item(&self->errlist, wand, item, pool->jpeg_snap) != 0) {
+			pthread_mutex_lock(&pool->lock);
+			pool->failed++;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	wand = DestroyMagickWand(wand);
+
+	return NULL;
+}
+
+/*
+ * Applies every crop in the manifest ("-" for stdin) with a pool of nthreads
+ * workers, each with its own wand. ImageMagick's own threading is capped so
+ * the two levels don't oversubscribe the cores. 0 threads means one per core.
+ */
+int run_batch(struct mu_error **err, const char *manifest, size_t nthreads, bool jpeg_snap)
+{
+	struct mu_batch_pool pool = { .jpeg_snap = jpeg_snap };
+	struct mu_batch_thread *threads;
+	uint64_t start, elapsed;
+	int ret = 0;
+
+	if (read_manifest(err, manifest, &pool.items, &pool.nitems) != 0)
+		return -1;
+
+	if (nthreads == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = n > 0 ? n : 1;
+	}
+	if (nthreads > pool.nitems)
+		nthreads = pool.nitems ? pool.nitems : 1;
+	if (nthreads > 1)
+		MagickSetResourceLimit(ThreadResource, 1);
+
+	threads = mallocz(nthreads * sizeof(struct mu_batch_thread));
+	if (threads == NULL) {
+		free_items(pool.items, pool.nitems);
+		MU_RET_ERRNO(err, ENOMEM);
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+
+	start = monotonic_ns();
+	for (size_t i = 0; i < nthreads; i++) {
+		threads[i].pool = &pool;
+		threads[i].errlist = create_errlist(1);
+		if (threads[i].errlist == NULL) {
+			MU_PUSH_ERRNO(err, ENOMEM);
+			ret = -1;
+			break;
+		}
+		if (pthread_create(&threads[i].thread, NULL, batch_main, &threads[i]) != 0) {
+			MU_PUSH_ERRSTR(err, "Could not start batch thread");
+			ret = -1;
+			break;
+		}
+		threads[i].started = true;
+	}
+
+	for (size_t i = 0; i < nthreads; i++) {
+		if (threads[i].started)
+			pthread_join(threads[i].thread, NULL);
+		if (threads[i].errlist) {
+			ret |= process_errors(threads[i].errlist);
+			free_errlist(&threads[i].errlist);
+		}
+	}
+	elapsed = monotonic_ns() - start;
+
+	fprintf(stderr, "%zu images (%zu failed) in %.3fs on %zu threads, %.1f images/s\n",
+			pool.nitems, pool.failed, elapsed / 1e9, nthreads,
+			elapsed ? pool.nitems / (elapsed / 1e9) : 0.0);
+
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	free_items(pool.items, pool.nitems);
+
+	return ret;
+}
@@ -0,0 +1,11 @@
+#ifndef MU_BATCH_H
+#define MU_BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util/error.h"
+
+extern int run_batch(struct mu_error **err, const char *manifest, size_t nthreads, bool jpeg_snap);
+
+#endif
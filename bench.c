@@ -0,0 +1,502 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "jpegcrop.h"
+#include "pyramid.h"
+#include "save.h"
+#include "scale.h"
+#include "tiled.h"
+#include "window.h"
+#include "util/error.h"
+#include "util/time.h"
+#include "util/wand.h"
+
+// Window the previews are scaled to, the size bench.sh gives Xvfb
+#define BENCH_WIDTH  1920
+#define BENCH_HEIGHT 1080
+// Frames per draw_bbox run, reported per frame
+#define BENCH_FRAMES 200
+
+enum bench_format {
+	BENCH_CSV,
+	BENCH_JSON
+};
+
+struct bench_timer {
+	uint64_t start;
+	uint64_t total;
+	uint64_t min;
+	unsigned int runs;
+};
+
+struct bench {
+	enum bench_format format;
+	const char *label;
+	const char *outdir;
+	unsigned int runs;
+	size_t rows;
+
+	struct mu_error *errlist;
+	struct mu_window *window;
+
+	// Image being measured
+	const char *filename;
+	char *magick;
+	size_t width;
+	size_t height;
+	size_t nframes;
+};
+
+static void timer_start(struct bench_timer *t)
+{
+	t->start = monotonic_ns();
+}
+
+static void timer_stop(struct bench_timer *t)
+{
+	uint64_t ns = monotonic_ns() - t->start;
+
+	if (t->runs == 0 || ns < t->min)
+		t->min = ns;
+	t->total += ns;
+	t->runs++;
+}
+
+// Waits until the server has processed everything sent so far
+static void sync_window(struct mu_window *window)
+{
+	xcb_generic_event_t *ev;
+
+	free(xcb_get_input_focus_reply(window->c, xcb_get_input_focus(window->c), NULL));
+	// Upload completions queued ahead of the reply free their segments
+	while ((ev = xcb_poll_for_queued_event(window->c)) != NULL) {
+		if (!handle_shm_event(window, ev))
+			handle_present_event(window, ev);
+		free(ev);
+	}
+}
+
+// Prints s as a quoted JSON string
+static void print_json(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+// Prints s as a quoted CSV field, doubling any quotes in it
+static void print_csv(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"')
+			putchar('"');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+// Prints one stage of the current image; times are divided by per, e.g. frames
+static void print_row(struct bench *b, const char *stage, struct bench_timer *t, unsigned int per)
+{
+	double mean, min;
+
+	if (t->runs == 0)
+		return;
+	mean = (double)t->total / t->runs / per / 1e6;
+	min  = (double)t->min / per / 1e6;
+
+	// Labels and filenames come from the command line and may hold anything
+	if (b->format == BENCH_JSON) {
+		printf("%s\n  {\"label\": ", b->rows ? "," : "");
+		print_json(b->label);
+		fputs(", \"image\": ", stdout);
+		print_json(b->filename);
+		fputs(", \"format\": ", stdout);
+		print_json(b->magick);
+		printf(", \"width\": %zu, \"height\": %zu, \"stage\": \"%s\", \"runs\": %u, \"mean_ms\": %.3f, \"min_ms\": %.3f}",
+				b->width, b->height, stage, t->runs, mean, min);
+	} else {
+		if (b->rows == 0)
+			puts("label,image,format,width,height,stage,runs,mean_ms,min_ms");
+		print_csv(b->label);
+		putchar(',');
+		print_csv(b->filename);
+		putchar(',');
+		print_csv(b->magick);
+		printf(",%zu,%zu,%s,%u,%.3f,%.3f\n", b->width, b->height, stage, t->runs, mean, min);
+	}
+	b->rows++;
+}
+
+static int bench_window(struct bench *b)
+{
+	b->window = create_window(&b->errlist, BENCH_WIDTH, BENCH_HEIGHT);
+	if (b->window == NULL)
+		return -1;
+
+	create_pixmap(&b->errlist, b->window, b->window->width, b->window->height);
+	create_gc(&b->errlist, b->window);
+	map_window(b->window);
+	sync_window(b->window);
+
+	return 0;
+}
+
+// Shows the queued frame and waits until it is on screen
+static void present_sync(struct bench *b)
+{
+	xcb_generic_event_t *ev;
+
+	present_frame(&b->errlist, b->window);
+	xcb_flush(b->window->c);
+	while (b->window->present.in_flight && (ev = xcb_wait_for_event(b->window->c)) != NULL) {
+		if (!handle_shm_event(b->window, ev))
+			handle_present_event(b->window, ev);
+		free(ev);
+	}
+	sync_window(b->window);
+}
+
+// Times the X stages on an already scaled preview
+static int bench_x11(struct bench *b, unsigned char *preview, size_t width, size_t height)
+{
+	struct bench_timer upload = { 0 }, bbox = { 0 }, present = { 0 };
+	int has_present = b->window->present.available;
+	Point p1 = { 0, 0 }, p2;
+
+	for (unsigned int i = 0; i < b->runs; i++) {
+		timer_start(&upload);
+		load_image(&b->errlist, b->window, preview, width * height * 4, width, height);
+		sync_window(b->window);
+		timer_stop(&upload);
+	}
+	print_row(b, "load_image", &upload, 1);
+
+	/*
+	 * A drag from the top-left corner, the way handle_mouse_motion draws it.
+	 * Frames are copied to the window rather than presented, so this times
+	 * composing them and not the refresh rate Present paces them to.
+	 */
+	b->window->present.available = 0;
+	for (unsigned int i = 0; i < b->runs; i++) {
+		timer_start(&bbox);
+		for (unsigned int f = 0; f < BENCH_FRAMES; f++) {
+			p2.x = b->window->width * (f + 1) / BENCH_FRAMES;
+			p2.y = b->window->height * (f + 1) / BENCH_FRAMES;
+			draw_bbox(&b->errlist, b->window, &p1, &p2);
+			present_frame(&b->errlist, b->window);
+			sync_window(b->window);
+		}
+		timer_stop(&bbox);
+	}
+	print_row(b, "draw_bbox", &bbox, BENCH_FRAMES);
+
+	if (!has_present)
+		return 0;
+
+	// The same drag, each frame waited for until Present shows it
+	b->window->present.available = 1;
+	// The back buffers are created again, two of them this time
+	b->window->present.width = 0;
+	for (unsigned int i = 0; i < b->runs; i++) {
+		timer_start(&present);
+		for (unsigned int f = 0; f < BENCH_FRAMES; f++) {
+			p2.x = b->window->width * (f + 1) / BENCH_FRAMES;
+			p2.y = b->window->height * (f + 1) / BENCH_FRAMES;
+			draw_bbox(&b->errlist, b->window, &p1, &p2);
+			present_sync(b);
+		}
+		timer_stop(&present);
+	}
+	print_row(b, "present_latency", &present, BENCH_FRAMES);
+
+	return 0;
+}
+
+/*
+ * Times one save through start_save() and wait_saves(), temporary file, syncs
+ * and rename included. master is handed over as a copy, or the crop is read
+ * from the file if it is NULL.
+ */
+static int time_save(struct bench *b, struct bench_timer *t, const struct mu_save *tmpl, MagickWand *master)
+{
+	struct mu_save *saves = NULL;
+	struct mu_save req = *tmpl;
+	int ret;
+
+	req.read = master == NULL;
+	req.master = master ? CloneMagickWand(master) : NewMagickWand();
+	if (req.master == NULL)
+		MU_RET_ERRNO(&b->errlist, ENOMEM);
+
+	timer_start(t);
+	ret = start_save(&b->errlist, &saves, &req);
+	if (ret == 0)
+		ret = wait_saves(&saves, NULL);
+	timer_stop(t);
+
+	return ret;
+}
+
+// Times saving the centered half of the image, the way crop_image does it
+static int bench_save(struct bench *b, MagickWand *master)
+{
+	struct bench_timer save = { 0 }, read = { 0 }, lossless = { 0 };
+	size_t x = b->width / 4, y = b->height / 4, width = b->width / 2, height = b->height / 2;
+	const char *ext = strrchr(b->filename, '.');
+	char dst[4096];
+	bool tiled = b->width * b->height > MU_TILED_AREA && is_tiff_file(b->filename);
+	struct mu_save req = {
+		.src_filename = b->filename,
+		.dst_filename = dst,
+		.tiled = tiled,
+		.nframes = b->nframes,
+		.crop = true,
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+	};
+	int ret = 0;
+
+	snprintf(dst, sizeof(dst), "%s/crop%s", b->outdir, ext ? ext : "");
+
+	// With the decoded master, unless crop_image would read the file anyway
+	if (!tiled && b->nframes == 1) {
+		for (unsigned int i = 0; i < b->runs && ret == 0; i++)
+			ret = time_save(b, &save, &req, master);
+		print_row(b, "crop_image", &save, 1);
+	}
+
+	// As for a draft master: lossless, extract, tiled or frames from the file
+	for (unsigned int i = 0; i < b->runs && ret == 0; i++)
+		ret = time_save(b, &read, &req, NULL);
+	print_row(b, "crop_read", &read, 1);
+
+	if (is_jpeg_filename(b->filename) && is_jpeg_filename(dst)) {
+		for (unsigned int i = 0; i < b->runs && ret == 0; i++) {
+			timer_start(&lossless);
+			if (jpeg_crop(&b->errlist, b->filename, dst, x, y, width, height, true) < 0)
+				ret = -1;
+			timer_stop(&lossless);
+		}
+		print_row(b, "jpeg_crop", &lossless, 1);
+	}
+
+	unlink(dst);
+	return ret;
+}
+
+static int bench_image(struct bench *b, const char *filename)
+{
+	struct bench_timer ping = { 0 }, decode = { 0 }, draft = { 0 }, pyramid = { 0 }, export = { 0 }, resize = { 0 };
+	size_t width = BENCH_WIDTH, height = BENCH_HEIGHT;
+	unsigned char *pixels = NULL, *preview = NULL;
+	MagickWand *wand = NewMagickWand(), *master = NewMagickWand();
+	struct mu_pyramid pyr = { .nlevels = 0 };
+	int ret = -1;
+
+	b->filename = filename;
+
+	for (unsigned int i = 0; i < b->runs; i++) {
+		ClearMagickWand(wand);
+		timer_start(&ping);
+		if (MagickPingImage(wand, filename) == MagickFalse) {
+			RaiseWandException(wand, &b->errlist);
+			goto out;
+		}
+		timer_stop(&ping);
+	}
+	b->nframes = MagickGetNumberImages(wand);
+	MagickResetIterator(wand);
+	b->width  = MagickGetImageWidth(wand);
+	b->height = MagickGetImageHeight(wand);
+	b->magick = MagickGetImageFormat(wand);
+	print_row(b, "ping_image", &ping, 1);
+
+	scale_to_window(&width, &height, BENCH_WIDTH, BENCH_HEIGHT);
+	if (width > b->width || height > b->height) {
+		width  = b->width;
+		height = b->height;
+	}
+
+	for (unsigned int i = 0; i < b->runs; i++) {
+		ClearMagickWand(wand);
+		timer_start(&decode);
+		if (MagickReadImage(wand, filename) == MagickFalse) {
+			RaiseWandException(wand, &b->errlist);
+			goto out;
+		}
+		timer_stop(&decode);
+	}
+	print_row(b, "decode", &decode, 1);
+
+	// What opening the image decodes before the first preview
+	for (unsigned int i = 0; i < b->runs; i++) {
+		ClearMagickWand(master);
+		timer_start(&draft);
+		ret = read_pyramid(&b->errlist, &pyr, master, filename, 1, b->width, b->height, width, height);
+		timer_stop(&draft);
+		destroy_pyramid(&pyr);
+		if (ret != 0)
+			goto out;
+	}
+	ret = -1;
+	print_row(b, "read_pyramid", &draft, 1);
+
+	for (unsigned int i = 0; i < b->runs; i++) {
+		init_pyramid(&pyr, wand);
+		timer_start(&pyramid);
+		ret = build_pyramid(&b->errlist, &pyr);
+		timer_stop(&pyramid);
+		destroy_pyramid(&pyr);
+		if (ret != 0)
+			goto out;
+	}
+	ret = -1;
+	print_row(b, "build_pyramid", &pyramid, 1);
+
+	pixels  = malloc(b->width * b->height * 4);
+	preview = malloc(width * height * 4);
+	if (pixels == NULL || preview == NULL) {
+		MU_PUSH_ERRNO(&b->errlist, ENOMEM);
+		goto out;
+	}
+
+	for (unsigned int i = 0; i < b->runs; i++) {
+		timer_start(&export);
+		if (MagickExportImagePixels(wand, 0, 0, b->width, b->height, "BGRA", CharPixel, pixels) == MagickFalse) {
+			RaiseWandException(wand, &b->errlist);
+			goto out;
+		}
+		timer_stop(&export);
+	}
+	print_row(b, "export_bgra", &export, 1);
+
+	for (unsigned int i = 0; i < b->runs; i++) {
+		timer_start(&resize);
+		if (downscale_bgra(pixels, b->width, b->height, b->width * 4, preview, width, height, width * 4, NULL, NULL) != 0) {
+			MU_PUSH_ERRNO(&b->errlist, ENOMEM);
+			goto out;
+		}
+		timer_stop(&resize);
+	}
+	print_row(b, "downscale", &resize, 1);
+
+	if (b->window && bench_x11(b, preview, width, height) != 0)
+		goto out;
+
+	ret = bench_save(b, wand);
+
+out:
+	free(pixels);
+	free(preview);
+	if (b->magick)
+		b->magick = MagickRelinquishMemory(b->magick);
+	master = DestroyMagickWand(master);
+	wand = DestroyMagickWand(wand);
+	return ret;
+}
+
+static void usage(bool err)
+{
+	fputs("usage: mucrop-bench [-f csv|json] [-l label] [-n runs] [-o outdir] <image>...\n", err ? stderr : stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b = { .format = BENCH_CSV, .label = "", .outdir = ".", .runs = 3 };
+	unsigned long runs;
+	char *end;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:hl:n:o:")) != -1) {
+		switch (opt) {
+			case 'f':
+				if (strcmp(optarg, "json") == 0) {
+					b.format = BENCH_JSON;
+				} else if (strcmp(optarg, "csv") != 0) {
+					usage(true);
+					return EX_USAGE;
+				}
+				break;
+			case 'h':
+				usage(false);
+				return 0;
+			case 'l':
+				b.label = optarg;
+				break;
+			case 'n':
+				errno = 0;
+				runs = strtoul(optarg, &end, 10);
+				if (errno != 0 || end == optarg || *end != '\0' || *optarg == '-' || runs == 0 || runs > UINT_MAX) {
+					fputs("mucrop-bench: runs must be a positive number\n", stderr);
+					usage(true);
+					return EX_USAGE;
+				}
+				b.runs = runs;
+				break;
+			case 'o':
+				b.outdir = optarg;
+				break;
+			default:
+				usage(true);
+				return EX_USAGE;
+		}
+	}
+	if (optind == argc || b.runs == 0) {
+		usage(true);
+		return EX_USAGE;
+	}
+
+	b.errlist = create_errlist(3);
+	if (b.errlist == NULL) {
+		perror("malloc");
+		return EX_OSERR;
+	}
+
+	MagickWandGenesis();
+
+	// Without a display the X stages are left out rather than failing the run
+	if (getenv("DISPLAY") == NULL)
+		fputs("mucrop-bench: DISPLAY is not set, skipping X stages\n", stderr);
+	else if (bench_window(&b) != 0)
+		ret = -1;
+
+	if (b.format == BENCH_JSON)
+		putchar('[');
+	for (int i = optind; ret == 0 && i < argc; i++)
+		ret = bench_image(&b, argv[i]);
+	if (b.format == BENCH_JSON)
+		puts("\n]");
+
+	ret |= process_errors(b.errlist);
+	free_errlist(&b.errlist);
+	if (b.window)
+		destroy_window(&b.window);
+	MagickWandTerminus();
+
+	return ret < 0 ? EX_SOFTWARE : 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Generates synthetic images and times each of mucrop's stages on them with
+# mucrop-bench, under Xvfb when there is no display.
+#
+# usage: bench.sh [csv|json]
+#
+# BENCH_SIZES, BENCH_EXTS and BENCH_RUNS override the defaults below.
+
+set -e
+
+format=${1:-csv}
+sizes=${BENCH_SIZES:-"1024x768 4000x3000 8000x6000"}
+exts=${BENCH_EXTS:-"jpg png tif"}
+runs=${BENCH_RUNS:-3}
+label=$(git describe --always --dirty 2>/dev/null || echo unknown)
+
+if command -v magick >/dev/null 2>&1; then
+	convert="magick"
+else
+	convert="convert"
+fi
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+mkdir "$dir/in"
+
+# Noise over a gradient, so encoders and decoders get realistic work
+for size in $sizes; do
+	$convert -size "$size" -seed 1 gradient:navy-orange -attenuate 0.4 +noise Gaussian "$dir/base.miff"
+	for ext in $exts; do
+		$convert "$dir/base.miff" "$dir/in/$size.$ext"
+	done
+done
+rm -f "$dir/base.miff"
+
+set -- ./mucrop-bench -f "$format" -l "$label" -n "$runs" -o "$dir" "$dir"/in/*
+
+if [ -z "$DISPLAY" ] && command -v xvfb-run >/dev/null 2>&1; then
+	xvfb-run -a -s "-screen 0 1920x1080x24" "$@"
+else
+	"$@"
+fi
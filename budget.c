@@ -0,0 +1,119 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "budget.h"
+#include "util/error.h"
+
+// Reads a byte count with an optional K, M, G or T suffix (powers of 1024)
+int parse_size(const char *str, size_t *size)
+{
+	unsigned long long value;
+	unsigned int shift = 0;
+	char *end;
+
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if (errno != 0 || end == str)
+		return -1;
+
+	switch (*end) {
+		case 'T': case 't':
+			shift += 10;
+			/* fallthrough */
+		case 'G': case 'g':
+			shift += 10;
+			/* fallthrough */
+		case 'M': case 'm':
+			shift += 10;
+			/* fallthrough */
+		case 'K': case 'k':
+			shift += 10;
+			end++;
+			break;
+		default:
+			break;
+	}
+	if (*end == 'B' || *end == 'b')
+		end++;
+	if (*end != '\0' || value > (~(size_t)0 >> shift))
+		return -1;
+
+	*size = (size_t)value << shift;
+	return 0;
+}
+
+/*
+ * Splits memory between the caches and hands ImageMagick the rest as its
+ * memory and map limits, with the matching pixel area. Pool buffers get an
+ * eighth, zoom tiles an eighth and undo previews a sixteenth. Of the disk,
+ * the pool's scratch files get a quarter and ImageMagick the rest, so the
+ * two together stay within it.
+ */
+int init_budget(struct mu_error **err, struct mu_budget *budget, size_t memory, size_t disk)
+{
+	memset(budget, 0, sizeof(struct mu_budget));
+	budget->memory = memory;
+	budget->disk = disk;
+
+	if (memory > 0) {
+		budget->pixels = memory / 8;
+		budget->tiles  = memory / 8;
+		budget->undo   = memory / 16;
+		budget->magick = memory - budget->pixels - budget->tiles - budget->undo;
+
+		if (MagickSetResourceLimit(MemoryResource, budget->magick) == MagickFalse ||
+				MagickSetResourceLimit(MapResource, budget->magick) == MagickFalse ||
+				MagickSetResourceLimit(AreaResource, budget->magick / (4 * sizeof(Quantum))) == MagickFalse)
+			MU_RET_ERRSTR(err, "Could not set ImageMagick's memory limits");
+	}
+	if (disk > 0) {
+		// 0 would mean no limit at all
+		budget->scratch = disk / 4 ? disk / 4 : 1;
+		budget->magick_disk = disk > budget->scratch ? disk - budget->scratch : 1;
+
+		if (MagickSetResourceLimit(DiskResource, budget->magick_disk) == MagickFalse)
+			MU_RET_ERRSTR(err, "Could not set ImageMagick's disk limit");
+	}
+
+	return 0;
+}
+
+/*
+ * Maps size bytes of an unlinked scratch file in $TMPDIR, so the pages can be
+ * written back to disk instead of staying resident. Returns NULL on failure.
+ */
+void *map_scratch(size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+	char path[4096];
+	void *addr;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/mucrop-XXXXXX", dir && *dir ? dir : "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0)
+		return NULL;
+	// The mapping keeps the file alive
+	unlink(path);
+
+	if (ftruncate(fd, size) != 0) {
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+void unmap_scratch(void *addr, size_t size)
+{
+	munmap(addr, size);
+}
@@ -0,0 +1,34 @@
+#ifndef MU_BUDGET_H
+#define MU_BUDGET_H
+
+#include <stddef.h>
+
+#include "util/error.h"
+
+/*
+ * One memory budget shared by ImageMagick's pixel cache and mucrop's own
+ * caches: pool buffers kept on the heap, zoom tiles and undo previews.
+ * A limit of 0 leaves that resource unbounded. Past their share, ImageMagick
+ * and the pool spill to files in $TMPDIR, each up to its share of the disk
+ * limit.
+ */
+struct mu_budget {
+	size_t memory;
+	size_t disk;
+
+	size_t magick;
+	size_t pixels;
+	size_t tiles;
+	size_t undo;
+
+	size_t magick_disk;
+	size_t scratch;
+};
+
+extern int parse_size(const char *str, size_t *size);
+extern int init_budget(struct mu_error **err, struct mu_budget *budget, size_t memory, size_t disk);
+
+extern void *map_scratch(size_t size);
+extern void unmap_scratch(void *addr, size_t size);
+
+#endif
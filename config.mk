@@ -5,9 +5,21 @@ PREFIX = /usr/local
 MAGICK_CFLAGS  = `pkg-config --cflags MagickWand`
 MAGICK_LDFLAGS = `pkg-config --libs MagickWand`
 
+# libjpeg
+JPEG_CFLAGS  = `pkg-config --cflags libjpeg`
+JPEG_LDFLAGS = `pkg-config --libs libjpeg`
+
+# libtiff
+TIFF_CFLAGS  = `pkg-config --cflags libtiff-4`
+TIFF_LDFLAGS = `pkg-config --libs libtiff-4`
+
 # xcb
-XCB_CFLAGS = `pkg-config --cflags xcb xcb-image xkbcommon xkbcommon-x11`
-XCB_LDFLAGS = `pkg-config --libs xcb xcb-image xkbcommon xkbcommon-x11`
+XCB_CFLAGS = `pkg-config --cflags xcb xcb-image xcb-present xcb-render xcb-shm xcb-xfixes xkbcommon xkbcommon-x11`
+XCB_LDFLAGS = `pkg-config --libs xcb xcb-image xcb-present xcb-render xcb-shm xcb-xfixes xkbcommon xkbcommon-x11`
+
+# threads
+THREAD_CFLAGS  = -pthread
+THREAD_LDFLAGS = -pthread
 
 # custom flags
 EXTRA_CFLAGS  = -std=c99
@@ -15,8 +27,8 @@ EXTRA_LDFLAGS =
 
 # flags
 WFLAGS  = -Wall -Wextra -Werror -Wno-unused-parameter
-CFLAGS  = $(WFLAGS) $(MAGICK_CFLAGS) $(XCB_CFLAGS) -pipe -fstack-protector -g -ggdb $(EXTRA_CFLAGS)
-LDFLAGS = $(MAGICK_LDFLAGS) $(XCB_LDFLAGS) $(EXTRA_LDFLAGS)
+CFLAGS  = $(WFLAGS) $(MAGICK_CFLAGS) $(JPEG_CFLAGS) $(TIFF_CFLAGS) $(XCB_CFLAGS) $(THREAD_CFLAGS) -pipe -fstack-protector -g -ggdb $(EXTRA_CFLAGS)
+LDFLAGS = $(MAGICK_LDFLAGS) $(JPEG_LDFLAGS) $(TIFF_LDFLAGS) $(XCB_LDFLAGS) $(THREAD_LDFLAGS) $(EXTRA_LDFLAGS)
 
 # compiler and linker
 CC = gcc
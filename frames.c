@@ -0,0 +1,276 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "frames.h"
+#include "trace.h"
+#include "util/error.h"
+#include "util/mem.h"
+#include "util/time.h"
+#include "util/wand.h"
+
+/*
+ * Frames being cropped by a pool of threads. Pages are read one by one
+ * straight from filename, only their crop; animation frames are split off
+ * the coalesced animation beforehand and filename is NULL.
+ */
+struct mu_frames {
+	pthread_mutex_t lock;
+	struct mu_error **err;
+	const char *filename;
+	MagickWand **frames;
+	size_t nframes;
+	size_t next;
+	bool failed;
+
+	size_t x;
+	size_t y;
+	size_t width;
+	size_t height;
+};
+
+struct mu_frame_thread {
+	pthread_t thread;
+	struct mu_frames *fr;
+	bool started;
+};
+
+// Formats whose frames are drawn over each other and have to be coalesced
+static bool is_animation(const char *format)
+{
+	return !strcasecmp(format, "GIF") || !strcasecmp(format, "WEBP") ||
+		!strcasecmp(format, "APNG") || !strcasecmp(format, "PNG") ||
+		!strcasecmp(format, "MNG");
+}
+
+static void frame_error(struct mu_frames *fr, MagickWand *wand)
+{
+	pthread_mutex_lock(&fr->lock);
+	RaiseWandException(wand, fr->err);
+	fr->failed = true;
+	pthread_mutex_unlock(&fr->lock);
+}
+
+static int crop_frame(struct mu_frames *fr, size_t i)
+{
+	MagickWand *wand = fr->frames[i];
+	char path[4096], geometry[64];
+	MagickBooleanType status;
+
+	if (fr->filename) {
+		snprintf(geometry, sizeof(geometry), "%zux%zu+%zu+%zu", fr->width, fr->height, fr->x, fr->y);
+		snprintf(path, sizeof(path), "%s[%zu]", fr->filename, i);
+		MagickSetExtract(wand, geometry);
+		status = MagickReadImage(wand, path);
+	} else {
+		status = MagickCropImage(wand, fr->width, fr->height, fr->x, fr->y);
+	}
+	if (status == MagickFalse) {
+		frame_error(fr, wand);
+		return -1;
+	}
+
+	// Cropped frames keep their offset on the old canvas
+	MagickSetImagePage(wand, MagickGetImageWidth(wand), MagickGetImageHeight(wand), 0, 0);
+
+	return 0;
+}
+
+static void *frames_main(void *data)
+{
+	struct mu_frames *fr = ((struct mu_frame_thread *)data)->fr;
+	struct mu_span span;
+
+	trace_thread_name("frames");
+
+	for (;;) {
+		size_t i;
+
+		pthread_mutex_lock(&fr->lock);
+		i = fr->failed ? fr->nframes : fr->next++;
+		pthread_mutex_unlock(&fr->lock);
+		if (i >= fr->nframes)
+			break;
+
+		span_begin(&span, "crop_frame");
+		crop_frame(fr, i);
+		span_end(&span);
+	}
+
+	return NULL;
+}
+
+// Crops every frame on nthreads threads, 0 meaning one per core
+static int run_frames(struct mu_error **err, struct mu_frames *fr, size_t nthreads)
+{
+	struct mu_frame_thread *threads;
+	int ret = 0;
+
+	if (nthreads == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = n > 0 ? n : 1;
+	}
+	if (nthreads > fr->nframes)
+		nthreads = fr->nframes;
+
+	threads = mallocz(nthreads * sizeof(struct mu_frame_thread));
+	if (threads == NULL)
+		MU_RET_ERRNO(err, ENOMEM);
+
+	for (size_t i = 0; i < nthreads; i++) {
+		threads[i].fr = fr;
+		if (pthread_create(&threads[i].thread, NULL, frames_main, &threads[i]) != 0) {
+			// The threads already started still get through every frame
+			if (i == 0)
+				ret = -1;
+			break;
+		}
+		threads[i].started = true;
+	}
+	for (size_t i = 0; i < nthreads; i++) {
+		if (threads[i].started)
+			pthread_join(threads[i].thread, NULL);
+	}
+	free(threads);
+
+	if (ret != 0)
+		MU_RET_ERRSTR(err, "Could not start frame threads");
+
+	return fr->failed ? -1 : 0;
+}
+
+// Splits the coalesced frames of filename into fr->frames
+static int split_animation(struct mu_error **err, struct mu_frames *fr, MagickWand *wand, const char *filename)
+{
+	MagickWand *coalesced;
+
+	if (MagickReadImage(wand, filename) == MagickFalse) {
+		RaiseWandException(wand, err);
+		return -1;
+	}
+	coalesced = MagickCoalesceImages(wand);
+	if (coalesced == NULL) {
+		RaiseWandException(wand, err);
+		return -1;
+	}
+	ClearMagickWand(wand);
+
+	// The frame count of the ping may be off for animations
+	fr->nframes = MagickGetNumberImages(coalesced);
+	fr->frames = mallocz(fr->nframes * sizeof(MagickWand *));
+	if (fr->frames == NULL) {
+		DestroyMagickWand(coalesced);
+		MU_RET_ERRNO(err, ENOMEM);
+	}
+	for (size_t i = 0; i < fr->nframes; i++) {
+		MagickSetIteratorIndex(coalesced, i);
+		fr->frames[i] = MagickGetImage(coalesced);
+		if (fr->frames[i] == NULL) {
+			RaiseWandException(coalesced, err);
+			DestroyMagickWand(coalesced);
+			return -1;
+		}
+	}
+	DestroyMagickWand(coalesced);
+
+	return 0;
+}
+
+/*
+ * Crops every frame of filename to width x height at x, y, with wand holding
+ * filename as pinged or read. On success wand holds the cropped frames, ready for
+ * MagickWriteImages(). Pages are decoded and cropped in parallel; animations
+ * are decoded and coalesced first, only their crops run in parallel, and GIFs
+ * are optimized again afterwards. The encode itself stays serial.
+ */
+int crop_frames(struct mu_error **err, MagickWand *wand, const char *filename,
+		size_t x, size_t y, size_t width, size_t height, size_t nthreads)
+{
+	struct mu_frames fr = { .err = err, .x = x, .y = y, .width = width, .height = height };
+	struct mu_span span;
+	char *format;
+	bool animated, gif;
+	int ret = -1;
+
+	MagickResetIterator(wand);
+	format = MagickGetImageFormat(wand);
+	animated = format && is_animation(format);
+	gif = format && !strcasecmp(format, "GIF");
+	if (format)
+		MagickRelinquishMemory(format);
+	fr.nframes = MagickGetNumberImages(wand);
+	ClearMagickWand(wand);
+
+	if (strlen(filename) + 24 > 4096)
+		MU_RET_ERRNO(err, ENAMETOOLONG);
+
+	if (animated) {
+		span_begin(&span, "coalesce");
+		ret = split_animation(err, &fr, wand, filename);
+		span_end(&span);
+		if (ret != 0)
+			goto out;
+	} else {
+		fr.filename = filename;
+		fr.frames = mallocz(fr.nframes * sizeof(MagickWand *));
+		if (fr.frames == NULL)
+			MU_RET_ERRNO(err, ENOMEM);
+		for (size_t i = 0; i < fr.nframes; i++) {
+			fr.frames[i] = NewMagickWand();
+			if (fr.frames[i] == NULL) {
+				MU_PUSH_ERRNO(err, ENOMEM);
+				goto out;
+			}
+		}
+	}
+
+	pthread_mutex_init(&fr.lock, NULL);
+	ret = run_frames(err, &fr, nthreads);
+	pthread_mutex_destroy(&fr.lock);
+	if (ret != 0)
+		goto out;
+
+	// Each frame goes after the last one added
+	for (size_t i = 0; ret == 0 && i < fr.nframes; i++) {
+		if (i > 0)
+			MagickSetLastIterator(wand);
+		if (MagickAddImage(wand, fr.frames[i]) == MagickFalse) {
+			RaiseWandException(wand, err);
+			ret = -1;
+		}
+	}
+
+	if (ret == 0 && gif) {
+		MagickWand *optimized;
+
+		span_begin(&span, "optimize");
+		optimized = MagickOptimizeImageLayers(wand);
+		if (optimized) {
+			MagickOptimizeImageTransparency(optimized);
+			ClearMagickWand(wand);
+			MagickAddImage(wand, optimized);
+			DestroyMagickWand(optimized);
+		}
+		span_end(&span);
+	}
+
+out:
+	if (fr.frames) {
+		for (size_t i = 0; i < fr.nframes; i++) {
+			if (fr.frames[i])
+				DestroyMagickWand(fr.frames[i]);
+		}
+		free(fr.frames);
+	}
+	if (ret != 0)
+		ClearMagickWand(wand);
+
+	return ret;
+}
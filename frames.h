@@ -0,0 +1,13 @@
+#ifndef MU_FRAMES_H
+#define MU_FRAMES_H
+
+#include <stddef.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "util/error.h"
+
+extern int crop_frames(struct mu_error **err, MagickWand *wand, const char *filename,
+		size_t x, size_t y, size_t width, size_t height, size_t nthreads);
+
+#endif
@@ -0,0 +1,213 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <jpeglib.h>
+
+#include "jpegcrop.h"
+#include "util/error.h"
+
+struct mu_jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf env;
+	char msg[JMSG_LENGTH_MAX];
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct mu_jpeg_error *jerr = (struct mu_jpeg_error *)cinfo->err;
+
+	jerr->mgr.format_message(cinfo, jerr->msg);
+	longjmp(jerr->env, 1);
+}
+
+static size_t div_round_up(size_t a, size_t b)
+{
+	return (a + b - 1) / b;
+}
+
+static size_t round_up(size_t a, size_t b)
+{
+	return div_round_up(a, b) * b;
+}
+
+static bool is_jpeg_file(FILE *fp)
+{
+	unsigned char magic[3];
+
+	if (fread(magic, 1, 3, fp) != 3)
+		return false;
+	rewind(fp);
+
+	return magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF;
+}
+
+/*
+ * Whether ImageMagick would write dst_filename as a JPEG, i.e. it has a JPEG
+ * extension or none at all (in which case the source format is kept).
+ */
+bool is_jpeg_filename(const char *filename)
+{
+	const char *slash = strrchr(filename, '/');
+	const char *ext = strrchr(filename, '.');
+
+	if (strchr(filename, ':') != NULL)
+		return false;
+	if (ext == NULL || (slash != NULL && ext < slash))
+		return true;
+
+	ext++;
+	return !strcasecmp(ext, "jpg") || !strcasecmp(ext, "jpeg") ||
+		!strcasecmp(ext, "jpe") || !strcasecmp(ext, "jfif");
+}
+
+// Copies APPn and COM markers, except those libjpeg already writes itself
+static void copy_markers(struct jpeg_decompress_struct *srcinfo, struct jpeg_compress_struct *dstinfo)
+{
+	jpeg_saved_marker_ptr marker;
+
+	for (marker = srcinfo->marker_list; marker != NULL; marker = marker->next) {
+		if (dstinfo->write_JFIF_header && marker->marker == JPEG_APP0 &&
+				marker->data_length >= 5 && !memcmp(marker->data, "JFIF", 5))
+			continue;
+		if (dstinfo->write_Adobe_marker && marker->marker == JPEG_APP0 + 14 &&
+				marker->data_length >= 5 && !memcmp(marker->data, "Adobe", 5))
+			continue;
+		jpeg_write_marker(dstinfo, marker->marker, marker->data, marker->data_length);
+	}
+}
+
+/*
+ * Crops a JPEG in the DCT domain by copying whole coefficient blocks, like
+ * jpegtran -crop. The origin must lie on the iMCU grid; with snap it is moved
+ * up/left onto it and the box grows to keep the requested area.
+ * Returns 0 on success, 1 if the crop cannot be done losslessly (the caller
+ * should fall back to a full decode) and -1 on error.
+ */
+int jpeg_crop(struct mu_error **err, const char *src_filename, const char *dst_filename,
+		size_t x, size_t y, size_t width, size_t height, bool snap)
+{
+	struct jpeg_decompress_struct srcinfo;
+	struct jpeg_compress_struct dstinfo;
+	struct mu_jpeg_error jsrcerr, jdsterr;
+	jvirt_barray_ptr *src_coefs, *dst_coefs;
+	FILE * volatile in = NULL;
+	FILE * volatile out = NULL;
+	size_t imcu_w, imcu_h;
+	int ret = 1;
+
+	in = fopen(src_filename, "rb");
+	if (in == NULL)
+		MU_RET_ERRNO(err, errno);
+	if (!is_jpeg_file(in)) {
+		fclose(in);
+		return 1;
+	}
+
+	srcinfo.err = jpeg_std_error(&jsrcerr.mgr);
+	jsrcerr.mgr.error_exit = jpeg_error_exit;
+	dstinfo.err = jpeg_std_error(&jdsterr.mgr);
+	jdsterr.mgr.error_exit = jpeg_error_exit;
+
+	jpeg_create_decompress(&srcinfo);
+	jpeg_create_compress(&dstinfo);
+
+	if (setjmp(jsrcerr.env)) {
+		MU_PUSH_ERRF(err, "%s: %s", src_filename, jsrcerr.msg);
+		ret = -1;
+		goto out;
+	}
+	if (setjmp(jdsterr.env)) {
+		MU_PUSH_ERRF(err, "%s: %s", dst_filename, jdsterr.msg);
+		ret = -1;
+		goto out;
+	}
+
+	jpeg_stdio_src(&srcinfo, in);
+	jpeg_save_markers(&srcinfo, JPEG_COM, 0xFFFF);
+	for (int i = 0; i < 16; i++)
+		jpeg_save_markers(&srcinfo, JPEG_APP0 + i, 0xFFFF);
+	jpeg_read_header(&srcinfo, TRUE);
+
+	imcu_w = srcinfo.max_h_samp_factor * DCTSIZE;
+	imcu_h = srcinfo.max_v_samp_factor * DCTSIZE;
+	if (snap) {
+		width  += x % imcu_w;
+		height += y % imcu_h;
+		x -= x % imcu_w;
+		y -= y % imcu_h;
+	} else if (x % imcu_w || y % imcu_h) {
+		goto out;
+	}
+	if (x + width > srcinfo.image_width)
+		width = srcinfo.image_width - x;
+	if (y + height > srcinfo.image_height)
+		height = srcinfo.image_height - y;
+	if (width == 0 || height == 0)
+		goto out;
+
+	// The destination arrays must be requested before the source is realized
+	dst_coefs = srcinfo.mem->alloc_small((j_common_ptr)&srcinfo, JPOOL_IMAGE,
+			sizeof(jvirt_barray_ptr) * srcinfo.num_components);
+	for (int ci = 0; ci < srcinfo.num_components; ci++) {
+		jpeg_component_info *comp = srcinfo.comp_info + ci;
+		size_t w_blocks = div_round_up(width * comp->h_samp_factor, imcu_w);
+		size_t h_blocks = div_round_up(height * comp->v_samp_factor, imcu_h);
+
+		dst_coefs[ci] = srcinfo.mem->request_virt_barray((j_common_ptr)&srcinfo, JPOOL_IMAGE, FALSE,
+				round_up(w_blocks, comp->h_samp_factor), round_up(h_blocks, comp->v_samp_factor),
+				comp->v_samp_factor);
+	}
+
+	src_coefs = jpeg_read_coefficients(&srcinfo);
+
+	// Everything is in memory now, so dst may safely be the source file
+	out = fopen(dst_filename, "wb");
+	if (out == NULL) {
+		MU_PUSH_ERRNO(err, errno);
+		ret = -1;
+		goto out;
+	}
+
+	jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
+	dstinfo.image_width = width;
+	dstinfo.image_height = height;
+	jpeg_stdio_dest(&dstinfo, out);
+	jpeg_write_coefficients(&dstinfo, dst_coefs);
+	copy_markers(&srcinfo, &dstinfo);
+
+	for (int ci = 0; ci < srcinfo.num_components; ci++) {
+		jpeg_component_info *comp = srcinfo.comp_info + ci;
+		size_t x_blocks = x / imcu_w * comp->h_samp_factor;
+		size_t y_blocks = y / imcu_h * comp->v_samp_factor;
+		size_t w_blocks = div_round_up(width * comp->h_samp_factor, imcu_w);
+		size_t h_blocks = div_round_up(height * comp->v_samp_factor, imcu_h);
+
+		for (size_t row = 0; row < h_blocks; row += comp->v_samp_factor) {
+			JBLOCKARRAY dst_buf = srcinfo.mem->access_virt_barray((j_common_ptr)&srcinfo,
+					dst_coefs[ci], row, comp->v_samp_factor, TRUE);
+			JBLOCKARRAY src_buf = srcinfo.mem->access_virt_barray((j_common_ptr)&srcinfo,
+					src_coefs[ci], row + y_blocks, comp->v_samp_factor, FALSE);
+
+			for (int off = 0; off < comp->v_samp_factor; off++)
+				memcpy(dst_buf[off], src_buf[off] + x_blocks, w_blocks * sizeof(JBLOCK));
+		}
+	}
+
+	jpeg_finish_compress(&dstinfo);
+	jpeg_finish_decompress(&srcinfo);
+	ret = 0;
+
+out:
+	jpeg_destroy_compress(&dstinfo);
+	jpeg_destroy_decompress(&srcinfo);
+	if (out != NULL && fclose(out) != 0 && ret == 0) {
+		MU_PUSH_ERRNO(err, errno);
+		ret = -1;
+	}
+	fclose(in);
+
+	return ret;
+}
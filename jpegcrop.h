@@ -0,0 +1,13 @@
+#ifndef MU_JPEGCROP_H
+#define MU_JPEGCROP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util/error.h"
+
+extern bool is_jpeg_filename(const char *filename);
+extern int jpeg_crop(struct mu_error **err, const char *src_filename, const char *dst_filename,
+		size_t x, size_t y, size_t width, size_t height, bool snap);
+
+#endif
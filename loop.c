@@ -0,0 +1,102 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <xcb/xcb.h>
+
+#include "loop.h"
+#include "util/error.h"
+#include "util/time.h"
+
+int init_loop(struct mu_error **err, struct mu_loop *loop, xcb_connection_t *c)
+{
+	loop->xfd = xcb_get_file_descriptor(c);
+	loop->timerfd = -1;
+	loop->wakefd = -1;
+
+	loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop->timerfd == -1)
+		MU_RET_ERRNO(err, errno);
+
+	loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wakefd == -1) {
+		int e = errno;
+		destroy_loop(loop);
+		MU_RET_ERRNO(err, e);
+	}
+
+	return 0;
+}
+
+void destroy_loop(struct mu_loop *loop)
+{
+	if (loop->timerfd != -1)
+		close(loop->timerfd);
+	if (loop->wakefd != -1)
+		close(loop->wakefd);
+	loop->timerfd = -1;
+	loop->wakefd = -1;
+}
+
+// (Re)arms the one-shot timer, pushing back any deadline already pending
+int arm_timer(struct mu_error **err, struct mu_loop *loop, unsigned int ms)
+{
+	struct itimerspec its = {};
+
+	ms_to_timespec(&its.it_value, ms);
+	if (timerfd_settime(loop->timerfd, 0, &its, NULL) == -1)
+		MU_RET_ERRNO(err, errno);
+
+	return 0;
+}
+
+void disarm_timer(struct mu_loop *loop)
+{
+	struct itimerspec its = {};
+
+	timerfd_settime(loop->timerfd, 0, &its, NULL);
+}
+
+void wake_loop(struct mu_loop *loop)
+{
+	uint64_t one = 1;
+
+	while (write(loop->wakefd, &one, sizeof(one)) == -1 && errno == EINTR)
+		;
+}
+
+/*
+ * Blocks until at least one source is ready and returns a mask of
+ * mu_loop_events. The caller must have drained xcb's own event queue first.
+ */
+int wait_loop(struct mu_error **err, struct mu_loop *loop)
+{
+	struct pollfd fds[3] = {
+		{ .fd = loop->xfd,     .events = POLLIN },
+		{ .fd = loop->timerfd, .events = POLLIN },
+		{ .fd = loop->wakefd,  .events = POLLIN }
+	};
+	uint64_t count;
+	int ret = 0;
+
+	while (poll(fds, 3, -1) == -1) {
+		if (errno != EINTR)
+			MU_RET_ERRNO(err, errno);
+	}
+
+	if (fds[0].revents)
+		ret |= MU_LOOP_X11;
+	if (fds[1].revents & POLLIN && read(loop->timerfd, &count, sizeof(count)) == sizeof(count))
+		ret |= MU_LOOP_TIMER;
+	if (fds[2].revents & POLLIN && read(loop->wakefd, &count, sizeof(count)) == sizeof(count))
+		ret |= MU_LOOP_WAKE;
+
+	return ret;
+}
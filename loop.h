@@ -0,0 +1,33 @@
+#ifndef MU_LOOP_H
+#define MU_LOOP_H
+
+#include <xcb/xcb.h>
+
+#include "util/error.h"
+
+enum mu_loop_events {
+	MU_LOOP_X11   = (1 << 0),
+	MU_LOOP_TIMER = (1 << 1),
+	MU_LOOP_WAKE  = (1 << 2)
+};
+
+/*
+ * Sleeps on the X connection, a debounce timer and an eventfd that other
+ * threads signal through wake_loop().
+ */
+struct mu_loop {
+	int xfd;
+	int timerfd;
+	int wakefd;
+};
+
+extern int init_loop(struct mu_error **err, struct mu_loop *loop, xcb_connection_t *c);
+extern void destroy_loop(struct mu_loop *loop);
+
+extern int arm_timer(struct mu_error **err, struct mu_loop *loop, unsigned int ms);
+extern void disarm_timer(struct mu_loop *loop);
+extern void wake_loop(struct mu_loop *loop);
+
+extern int wait_loop(struct mu_error **err, struct mu_loop *loop);
+
+#endif
@@ -1,19 +1,37 @@
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
 #include <errno.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <sysexits.h>
-#include <time.h>
 #include <unistd.h>
 
 #include <xkbcommon/xkbcommon.h>
 
 #include <MagickWand/MagickWand.h>
 
+#include "batch.h"
+#include "budget.h"
+#include "jpegcrop.h"
+#include "loop.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "pyramid.h"
+#include "save.h"
+#include "tiled.h"
+#include "tiles.h"
+#include "trace.h"
 #include "window.h"
+#include "worker.h"
 #include "util/error.h"
+#include "util/mem.h"
 #include "util/time.h"
+#include "util/wand.h"
 
 enum mucrop_states {
 	MU_COMP = (1 << 1),
@@ -21,17 +39,70 @@ enum mucrop_states {
 	MU_QUIT = (1 << 3),
 	MU_RESI = (1 << 4),
 	MU_SAVE = (1 << 5),
-	MU_UNDO = (1 << 6),
-	MU_WAIT = (1 << 7)
+	MU_UNDO = (1 << 6), // The preview on screen is final and can be kept for undo
+	MU_PAN  = (1 << 7),
+	MU_NEXT = (1 << 8),
+	MU_PREV = (1 << 9)
+};
+
+// Any of these ends the event loop for the current image
+#define MU_LEAVE (MU_QUIT | MU_NEXT | MU_PREV)
+
+// Time the window geometry has to stay unchanged before the preview is refined
+#define MU_RESIZE_DELAY 500
+
+/*
+ * With server-side scaling a preview is kept while the window is between
+ * these fractions of its size; beyond that it is rendered again
+ */
+#define MU_RENDER_MIN_SCALE 0.5
+#define MU_RENDER_MAX_SCALE 1.0
+
+// Crops kept for undo, and the server memory their previews may take
+#define MU_UNDO_MAX 64
+#define MU_UNDO_BUDGET (32 << 20)
+
+// One step of the crop history; id keys its preview in the undo cache
+struct mu_crop_step {
+	bool crop;
+	size_t x;
+	size_t y;
+	size_t width;
+	size_t height;
+	unsigned long id;
 };
 
 struct mucrop_core {
 	MagickWand *wand;
+	MagickWand *master;
+	struct mu_pyramid pyramid;
 	struct mu_window *window;
 	struct mu_error *errlist;
-
-	unsigned char *image;
-	size_t length;
+	struct mu_loop loop;
+	struct mu_worker worker;
+	struct mu_pool pool;
+	struct mu_budget budget;
+
+	// Files of the session; dst_filename is only set for a single file
+	char **files;
+	size_t nfiles;
+	size_t index;
+	int direction;
+	struct mu_prefetch prefetch;
+
+	const char *src_filename;
+	const char *dst_filename;
+	bool jpeg_snap;
+	bool tiled;
+	// Frames or pages of the source; previews show the first one, crops apply to all
+	size_t nframes;
+	// Previews are rendered screen sized and scaled to the window by XRender
+	bool render;
+
+	// Crops still being written, and whether any that finished failed
+	struct mu_save *saves;
+	int save_ret;
+	bool wait;
 
 	size_t o_width;
 	size_t o_height;
@@ -40,28 +111,53 @@ struct mucrop_core {
 
 	Point bound_origin;
 
-	Point crop_origin;
+	// Region of the master shown by the current preview
+	size_t view_x;
+	size_t view_y;
+	size_t view_width;
+	size_t view_height;
+
+	size_t crop_x;
+	size_t crop_y;
 	size_t crop_width;
 	size_t crop_height;
 
+	// Zoom steps above fit-to-window, and the window's top-left in the zoomed view
+	struct mu_tile_cache tiles;
+	unsigned int zoom;
+	size_t pan_x;
+	size_t pan_y;
+	Point pan_last;
+
+	// Crop history, steps[0] being the whole image, and the previews of its steps
+	struct mu_crop_step steps[MU_UNDO_MAX];
+	size_t nsteps;
+	size_t step;
+	unsigned long step_id;
+	struct mu_tile_cache previews;
+
 	uint16_t state_flags;
 };
 
-#define RaiseWandException(wand, errlist) \
-{ \
-	char *description; \
-	ExceptionType severity; \
-\
-	description = MagickGetException(wand, &severity); \
-	MU_PUSH_ERRSTR(errlist, description); \
-	description = (char *) MagickRelinquishMemory(description); \
-}
+/*
+ * Events drained from the queue in one loop iteration. Motion collapses to the
+ * latest position and exposed rectangles are unioned into one damage region.
+ */
+struct mucrop_batch {
+	xcb_motion_notify_event_t motion;
+	xcb_expose_event_t expose;
+	bool has_motion;
+	bool has_expose;
+};
 
 int ping_image(struct mucrop_core *core, const char *filename)
 {
 	MagickBooleanType status;
+	struct mu_span span;
 
+	span_begin(&span, "ping");
 	status = MagickPingImage(core->wand, filename);
+	span_end(&span);
 	if (status == MagickFalse) {
 		RaiseWandException(core->wand, &core->errlist);
 		return -1;
@@ -70,69 +166,414 @@ int ping_image(struct mucrop_core *core, const char *filename)
 	// Get Output Resolution/Preferred Output Format
 	// Convert Copy of Image to Format (RGBA/YUV/Whatever)
 	// GetImageBlob and destroy copy of Image
-	/* MagickResetIterator(core->wand); */
+	// Reading leaves the wand on the last frame, the preview is of the first
+	core->nframes = MagickGetNumberImages(core->wand);
+	MagickResetIterator(core->wand);
 	core->o_width  = MagickGetImageWidth(core->wand);
 	core->o_height = MagickGetImageHeight(core->wand);
+	core->tiled = core->o_width * core->o_height > MU_TILED_AREA && is_tiff_file(filename);
+
+	ClearMagickWand(core->wand);
 
 	return 0;
 }
 
-int read_image(struct mucrop_core *core, const char *filename)
+// Describes the current view (cropped if MU_CROP is set) at window size
+static void view_job(struct mucrop_core *core, struct mu_job *job, enum mu_quality quality)
 {
-	MagickBooleanType status;
+	job->quality = quality;
 
-	core->width = core->o_width;
-	core->height = core->o_height;
+	if (core->state_flags & MU_CROP) {
+		job->x = core->crop_x;
+		job->y = core->crop_y;
+		job->s_width  = core->crop_width;
+		job->s_height = core->crop_height;
+	} else {
+		job->x = 0;
+		job->y = 0;
+		job->s_width  = core->o_width;
+		job->s_height = core->o_height;
+	}
 
-	status = MagickReadImage(core->wand, filename);
-	if (status == MagickFalse) {
-		RaiseWandException(core->wand, &core->errlist);
+	job->width  = job->s_width;
+	job->height = job->s_height;
+	scale_to_window(&job->width, &job->height, core->window->width, core->window->height);
+}
+
+// Size previews are fitted into: the window, or the screen when the server scales them
+static void preview_bounds(struct mucrop_core *core, size_t *width, size_t *height)
+{
+	xcb_screen_t *screen = core->window->screen;
+
+	*width  = core->window->width;
+	*height = core->window->height;
+	if (core->render) {
+		if (*width < screen->width_in_pixels)
+			*width = screen->width_in_pixels;
+		if (*height < screen->height_in_pixels)
+			*height = screen->height_in_pixels;
+	}
+}
+
+// Describes the preview to render for the current view
+static void preview_job(struct mucrop_core *core, struct mu_job *job, enum mu_quality quality)
+{
+	size_t width, height;
+
+	view_job(core, job, quality);
+	preview_bounds(core, &width, &height);
+	job->width  = job->s_width;
+	job->height = job->s_height;
+	scale_to_window(&job->width, &job->height, width, height);
+}
+
+// Records the region of the preview going on screen and the size it is shown at
+static void set_view(struct mucrop_core *core, struct mu_job *job)
+{
+	core->width  = job->width;
+	core->height = job->height;
+	if (core->render) {
+		core->width  = job->s_width;
+		core->height = job->s_height;
+		scale_to_window(&core->width, &core->height, core->window->width, core->window->height);
+	}
+
+	core->view_x = job->x;
+	core->view_y = job->y;
+	core->view_width  = job->s_width;
+	core->view_height = job->s_height;
+}
+
+// Makes a rendered preview the displayed one and hands its buffer back to the pool
+static int show_result(struct mucrop_core *core, struct mu_result *res)
+{
+	int ret;
+
+	if (res->ret != 0)
 		return -1;
+
+	// Zoomed views are composed from tiles instead
+	if (core->zoom > 0) {
+		release_buffer(&core->pool, res->image);
+		return 0;
 	}
 
-	scale_to_window(&core->width, &core->height, core->window->width, core->window->height);
-	if ((core->width != core->o_width) || (core->height != core->o_height))
-		MagickResizeImage(core->wand, core->width, core->height, LanczosFilter);
+	set_view(core, &res->job);
+	if (res->job.quality == MU_QUALITY_FINAL)
+		core->state_flags |= MU_UNDO;
+	else
+		core->state_flags &= ~MU_UNDO;
 
-	MagickSetImageFormat(core->wand, "bgra");
-	core->image = MagickGetImageBlob(core->wand, &core->length);
+	ret = load_image(&core->errlist, core->window, res->image, res->length, res->job.width, res->job.height);
+	release_buffer(&core->pool, res->image);
+	if (ret == 0 && core->render)
+		ret = scale_image(&core->errlist, core->window, core->width, core->height);
 
-	ClearMagickWand(core->wand);
+	return ret;
+}
+
+// Returns 1 if the file could not be decoded, -1 if the preview could not be shown
+int read_image(struct mucrop_core *core, const char *filename)
+{
+	struct mu_result res;
+	struct mu_span span;
+	struct mu_job job;
+	int ret;
+
+	preview_job(core, &job, MU_QUALITY_FAST);
+
+	if (core->tiled) {
+		// Previews decode only what they need straight from the file
+		init_pyramid_tiled(&core->pyramid, filename, core->o_width, core->o_height);
+	} else {
+		// Only as much as the first preview shows, the worker decodes the rest on demand
+		span_begin(&span, "decode");
+		ret = read_pyramid(&core->errlist, &core->pyramid, core->master, filename, core->nframes,
+				core->o_width, core->o_height, job.width, job.height);
+		span_end(&span);
+		trace_counters();
+		if (ret != 0)
+			return 1;
+	}
+
+	if (render_job(&core->errlist, &core->pyramid, &core->pool, &job, &res, NULL, NULL) != 0)
+		return -1;
+
+	return show_result(core, &res);
+}
+
+/*
+ * Queues a re-render of the current view, the old preview stays up until it is
+ * done. A fast preview is followed by a final one once the geometry settles.
+ */
+int reload_image(struct mucrop_core *core, enum mu_quality quality)
+{
+	struct mu_job job;
+
+	preview_job(core, &job, quality);
+	submit_job(&core->worker, &job);
 
 	return 0;
 }
 
-int reload_image(struct mucrop_core *core, const char *filename)
+// Keeps a copy of the final preview on screen for coming back to this step
+static int keep_preview(struct mucrop_core *core)
 {
-	MagickBooleanType status;
-	size_t width, height;
+	struct mu_tile_key key = { .tx = core->steps[core->step].id };
+	struct mu_tile *tile;
 
-	status = MagickReadImage(core->wand, filename);
-	if (status == MagickFalse) {
-		RaiseWandException(core->wand, &core->errlist);
+	if (!(core->state_flags & MU_UNDO) || core->nsteps == 0)
+		return 0;
+
+	tile = find_tile(&core->previews, &key);
+	if (tile)
+		drop_tile(&core->previews, core->window->c, tile);
+
+	return insert_tile(&core->errlist, &core->previews, core->window->c, &key,
+			copy_pixmap(core->window), core->window->pix_width, core->window->pix_height);
+}
+
+// Records the current crop as the newest step, dropping the ones undone before it
+static void push_step(struct mucrop_core *core)
+{
+	struct mu_crop_step *step;
+
+	if (core->nsteps > 0)
+		core->nsteps = core->step + 1;
+	if (core->nsteps == MU_UNDO_MAX) {
+		memmove(core->steps, core->steps + 1, (MU_UNDO_MAX - 1) * sizeof(struct mu_crop_step));
+		core->nsteps--;
+	}
+
+	step = &core->steps[core->nsteps];
+	step->crop = core->state_flags & MU_CROP;
+	step->x = core->crop_x;
+	step->y = core->crop_y;
+	step->width  = core->crop_width;
+	step->height = core->crop_height;
+	step->id = ++core->step_id;
+	core->step = core->nsteps++;
+}
+
+/*
+ * Moves delta steps through the crop history. A step whose preview is still
+ * cached at the current window size is shown from it without touching the
+ * image, others are rendered again from the pyramid.
+ */
+static int step_history(struct mucrop_core *core, int delta)
+{
+	struct mu_crop_step *step;
+	struct mu_tile_key key;
+	struct mu_tile *tile;
+	struct mu_job job;
+
+	if (delta < 0 ? core->step == 0 : core->step + 1 >= core->nsteps)
+		return 0;
+	if (keep_preview(core) != 0)
+		return -1;
+
+	core->step += delta;
+	step = &core->steps[core->step];
+	core->state_flags = (core->state_flags & ~(MU_COMP | MU_CROP | MU_UNDO)) | (step->crop ? MU_CROP : 0);
+	core->crop_x = step->x;
+	core->crop_y = step->y;
+	core->crop_width  = step->width;
+	core->crop_height = step->height;
+
+	core->zoom = 0;
+	flush_tiles(&core->tiles, core->window->c);
+
+	preview_job(core, &job, MU_QUALITY_FINAL);
+	key = (struct mu_tile_key){ .tx = step->id };
+	tile = find_tile(&core->previews, &key);
+	if (tile == NULL || tile->width != job.width || tile->height != job.height)
+		return reload_image(core, MU_QUALITY_FAST);
+
+	// Whatever was rendering belongs to the step just left
+	cancel_job(&core->worker);
+	set_view(core, &job);
+	core->state_flags |= MU_UNDO;
+
+	if (show_pixmap(&core->errlist, core->window, tile->pix, job.width, job.height) != 0)
 		return -1;
+	return core->render ? scale_image(&core->errlist, core->window, core->width, core->height) : 0;
+}
+
+/*
+ * Scales the preview on screen to the resized window on the server. Returns 1
+ * if it is still close enough to its rendered size to keep.
+ */
+static int fit_view(struct mucrop_core *core)
+{
+	size_t width = core->view_width, height = core->view_height;
+	double scale;
+
+	if (!core->render)
+		return 0;
+
+	scale_to_window(&width, &height, core->window->width, core->window->height);
+	if (scale_image(&core->errlist, core->window, width, height) != 0)
+		return -1;
+	core->width  = width;
+	core->height = height;
+
+	scale = (double)width / core->window->pix_width;
+	return scale >= MU_RENDER_MIN_SCALE && scale <= MU_RENDER_MAX_SCALE;
+}
+
+/*
+ * Returns the shift of the current zoom step, whose view is the base view
+ * scaled by 2^-shift. Step 1 is the first power of two above fit-to-window and
+ * each further step doubles it until the view is shown 1:1.
+ */
+static unsigned int zoom_shift(struct mucrop_core *core, struct mu_job *base)
+{
+	unsigned int shift = 0;
+
+	view_job(core, base, MU_QUALITY_FINAL);
+	while ((base->s_width >> (shift + 1)) > base->width)
+		shift++;
+
+	return core->zoom - 1 > shift ? 0 : shift - (core->zoom - 1);
+}
+
+/*
+ * Composes the visible part of the zoomed view from cached tiles and queues
+ * the missing ones on the worker. The displayed view region is updated so
+ * bound_compute() maps through the zoom and pan.
+ */
+static int compose_view(struct mucrop_core *core)
+{
+	struct mu_job base, jobs[MU_WORKER_QUEUE];
+	size_t zw, zh, vw, vh, njobs = 0;
+	unsigned int shift = zoom_shift(core, &base);
+
+	zw = base.s_width >> shift;
+	zh = base.s_height >> shift;
+	if (zw == 0)
+		zw = 1;
+	if (zh == 0)
+		zh = 1;
+	vw = zw < core->window->width ? zw : core->window->width;
+	vh = zh < core->window->height ? zh : core->window->height;
+	if (core->pan_x > zw - vw)
+		core->pan_x = zw - vw;
+	if (core->pan_y > zh - vh)
+		core->pan_y = zh - vh;
+
+	begin_view(&core->errlist, core->window, vw, vh);
+	core->state_flags &= ~MU_UNDO;
+
+	for (size_t ty = core->pan_y / MU_TILE_SIZE; ty * MU_TILE_SIZE < core->pan_y + vh; ty++) {
+		for (size_t tx = core->pan_x / MU_TILE_SIZE; tx * MU_TILE_SIZE < core->pan_x + vw; tx++) {
+			struct mu_tile_key key = { shift, tx, ty, core->tiles.epoch };
+			size_t x0 = tx * MU_TILE_SIZE, y0 = ty * MU_TILE_SIZE;
+			size_t x1 = x0 + MU_TILE_SIZE > zw ? zw : x0 + MU_TILE_SIZE;
+			size_t y1 = y0 + MU_TILE_SIZE > zh ? zh : y0 + MU_TILE_SIZE;
+			struct mu_tile *tile = find_tile(&core->tiles, &key);
+			struct mu_job *job;
+
+			if (tile) {
+				blit_tile(core->window, tile->pix, x0 - core->pan_x, y0 - core->pan_y, tile->width, tile->height);
+				continue;
+			}
+			if (njobs == MU_WORKER_QUEUE)
+				continue;
+
+			// Tile edges map to source edges, so neighbouring tiles never overlap or leave gaps
+			job = &jobs[njobs++];
+			*job = base;
+			job->key = key;
+			job->x = base.x + (x0 << shift);
+			job->y = base.y + (y0 << shift);
+			job->s_width  = (x1 == zw ? base.s_width : x1 << shift) - (x0 << shift);
+			job->s_height = (y1 == zh ? base.s_height : y1 << shift) - (y0 << shift);
+			job->width  = x1 - x0;
+			job->height = y1 - y0;
+		}
 	}
+	submit_tiles(&core->worker, jobs, njobs);
 
-	if (core->state_flags & MU_CROP) {
-		width  = core->width  = core->crop_width;
-		height = core->height = core->crop_height;
-		MagickCropImage(core->wand, core->width, core->height, core->crop_origin.x, core->crop_origin.y);
-	} else {
-		width  = core->width  = core->o_width;
-		height = core->height = core->o_height;
+	core->width  = vw;
+	core->height = vh;
+	core->view_x = base.x + (core->pan_x << shift);
+	core->view_y = base.y + (core->pan_y << shift);
+	core->view_width  = vw == zw ? base.s_width : vw << shift;
+	core->view_height = vh == zh ? base.s_height : vh << shift;
+
+	return present_view(&core->errlist, core->window, vw, vh);
+}
+
+// Caches a rendered tile unless the view it belongs to is gone
+static int show_tile(struct mucrop_core *core, struct mu_result *res)
+{
+	xcb_pixmap_t pix;
+	int ret = 0;
+
+	if (res->ret != 0)
+		return -1;
+
+	if (res->job.key.epoch == core->tiles.epoch) {
+		pix = upload_pixmap(&core->errlist, core->window, res->image, res->length, res->job.width, res->job.height);
+		ret = insert_tile(&core->errlist, &core->tiles, core->window->c, &res->job.key, pix,
+				res->job.width, res->job.height);
 	}
+	release_buffer(&core->pool, res->image);
 
-	scale_to_window(&core->width, &core->height, core->window->width, core->window->height);
-	if ((core->width != width) || (core->height != height))
-		MagickResizeImage(core->wand, core->width, core->height, LanczosFilter);
+	return ret;
+}
 
-	MagickSetImageFormat(core->wand, "bgra");
-	core->image = MagickGetImageBlob(core->wand, &core->length);
+/*
+ * Zooms one step in or out, keeping the source pixel under the pointer in
+ * place. Zooming back out to step 0 returns to the fitted preview.
+ */
+static int zoom_view(struct mucrop_core *core, bool in, int16_t px, int16_t py)
+{
+	struct mu_job base;
+	unsigned int shift;
+	double sx, sy;
+	int32_t wx = px - core->window->xoff, wy = py - core->window->yoff;
+
+	if (wx < 0)
+		wx = 0;
+	if (wy < 0)
+		wy = 0;
+	if ((size_t)wx > core->width)
+		wx = core->width;
+	if ((size_t)wy > core->height)
+		wy = core->height;
+
+	shift = zoom_shift(core, &base);
+	if (in && (core->zoom > 0 ? shift == 0 : base.width >= base.s_width))
+		return 0;
+	if (!in && core->zoom == 0)
+		return 0;
 
-	ClearMagickWand(core->wand);
+	// Source position under the pointer, relative to the base view
+	sx = core->view_x - base.x + wx * (double)core->view_width / core->width;
+	sy = core->view_y - base.y + wy * (double)core->view_height / core->height;
+
+	core->zoom += in ? 1 : -1;
+	if (core->zoom == 0)
+		return reload_image(core, MU_QUALITY_FAST);
+
+	shift = zoom_shift(core, &base);
+	core->pan_x = sx / (1 << shift) > wx ? sx / (1 << shift) - wx : 0;
+	core->pan_y = sy / (1 << shift) > wy ? sy / (1 << shift) - wy : 0;
 
-	return load_image(&core->errlist, core->window, core->image, core->length, core->width, core->height);
-;
+	return compose_view(core);
+}
+
+static int pan_view(struct mucrop_core *core, Point *cur_pos)
+{
+	int64_t x = (int64_t)core->pan_x - (cur_pos->x - core->pan_last.x);
+	int64_t y = (int64_t)core->pan_y - (cur_pos->y - core->pan_last.y);
+
+	core->pan_x = x < 0 ? 0 : x;
+	core->pan_y = y < 0 ? 0 : y;
+	core->pan_last = *cur_pos;
+
+	return compose_view(core);
 }
 
 int bound_init(Point *bound_origin, xcb_button_press_event_t *ev)
@@ -194,48 +635,64 @@ int bound_compute(struct mucrop_core *core, Point *bound_origin, xcb_button_rele
 	if (width <= 0 || height <= 0)
 		return 0;
 
-	if (core->state_flags & MU_CROP) {
-		scale_x = (double)core->crop_width / (double)core->width;
-		scale_y = (double)core->crop_height / (double)core->height;
-	} else {
-		scale_x = (double)core->o_width / (double)core->width;
-		scale_y = (double)core->o_height / (double)core->height;
-	}
+	scale_x = (double)core->view_width / (double)core->width;
+	scale_y = (double)core->view_height / (double)core->height;
 
 	x      *= scale_x;
 	width  *= scale_x;
 	y      *= scale_y;
 	height *= scale_y;
 
-	if (core->state_flags & MU_CROP) {
-		x += core->crop_origin.x;
-		y += core->crop_origin.y;
-	}
+	x += core->view_x;
+	y += core->view_y;
 
-	core->crop_origin.x = x;
-	core->crop_origin.y = y;
+	core->crop_x = x;
+	core->crop_y = y;
 	core->crop_width = width;
 	core->crop_height = height;
 
 	return 1;
 }
 
-int crop_image(struct mucrop_core *core, const char *src_filename, const char *dst_filename)
+/*
+ * Hands the crop to a save thread along with the master, which core replaces
+ * by an empty wand. Tiled sources and draft-only pyramids have no master, the
+ * save reads the crop from the file instead: only its tiles or strips for
+ * tiled sources, the whole image for drafts.
+ */
+int crop_image(struct mucrop_core *core, const char *dst_filename)
 {
-	MagickBooleanType status;
-
-	status = MagickReadImage(core->wand, src_filename);
-	if (status == MagickFalse) {
-		RaiseWandException(core->wand, &core->errlist);
-		return -1;
+	struct mu_save req = {
+		.src_filename = core->src_filename,
+		.dst_filename = dst_filename,
+		.read = core->tiled || core->pyramid.pending || core->nframes > 1,
+		.tiled = core->tiled,
+		.nframes = core->nframes,
+		.crop = core->state_flags & MU_CROP,
+		.x = core->crop_x,
+		.y = core->crop_y,
+		.width = core->crop_width,
+		.height = core->crop_height,
+		.jpeg_snap = core->jpeg_snap
+	};
+	int ret;
+
+	req.master = NewMagickWand();
+	if (req.master == NULL)
+		MU_RET_ERRNO(&core->errlist, ENOMEM);
+	if (!req.read) {
+		MagickWand *master = core->master;
+
+		core->master = req.master;
+		req.master = master;
+		core->pyramid.level[0] = core->master;
 	}
 
-	MagickCropImage(core->wand, core->crop_width, core->crop_height, core->crop_origin.x, core->crop_origin.y);
-	MagickWriteImage(core->wand, dst_filename);
+	ret = start_save(&core->errlist, &core->saves, &req);
+	if (ret == 0 && core->wait)
+		core->save_ret |= wait_saves(&core->saves, dst_filename);
 
-	ClearMagickWand(core->wand);
-
-	return 1;
+	return ret;
 }
 
 int handle_mouse_motion(struct mucrop_core *core, Point *bound_origin, xcb_motion_notify_event_t *ev)
@@ -244,6 +701,8 @@ int handle_mouse_motion(struct mucrop_core *core, Point *bound_origin, xcb_motio
 
 	if (core->state_flags & MU_COMP) {
 		return draw_bbox(&core->errlist, core->window, bound_origin, &cur_pos);
+	} else if (core->state_flags & MU_PAN) {
+		return pan_view(core, &cur_pos);
 	}
 	return 0;
 }
@@ -255,9 +714,21 @@ int handle_buttonpress(struct mucrop_core *core, xcb_button_press_event_t *butto
 			if (bound_init(&core->bound_origin, button) > 0)
 				core->state_flags |= MU_COMP;
 			break;
+		case 0x02:
+			if (core->zoom > 0 && !(core->state_flags & MU_COMP)) {
+				core->state_flags |= MU_PAN;
+				core->pan_last.x = button->event_x;
+				core->pan_last.y = button->event_y;
+			}
+			break;
 		case 0x03:
 			core->state_flags &= ~MU_COMP;
 			return clear_bbox(&core->errlist, core->window, NULL, NULL);
+		case 0x04:
+		case 0x05:
+			if (!(core->state_flags & (MU_COMP | MU_PAN)))
+				return zoom_view(core, button->detail == 0x04, button->event_x, button->event_y);
+			break;
 		default:
 			break;
 	}
@@ -274,8 +745,20 @@ int handle_keypress(struct mucrop_core *core, xcb_key_press_event_t *key)
 			core->state_flags |= MU_QUIT;
 			break;
 		case XKB_KEY_w: // w
-			core->state_flags |= MU_QUIT | MU_SAVE;
+			core->state_flags |= MU_SAVE | (core->index + 1 < core->nfiles ? MU_NEXT : MU_QUIT);
+			break;
+		case XKB_KEY_n: // n
+			if (core->index + 1 < core->nfiles)
+				core->state_flags |= MU_NEXT;
 			break;
+		case XKB_KEY_p: // p
+			if (core->index > 0)
+				core->state_flags |= MU_PREV;
+			break;
+		case XKB_KEY_u: // u
+			return step_history(core, -1);
+		case XKB_KEY_r: // r
+			return step_history(core, 1);
 		case XKB_KEY_Escape: // ESC
 			core->state_flags &= ~MU_COMP;
 			return clear_bbox(&core->errlist, core->window, NULL, NULL);
@@ -292,34 +775,594 @@ static void handle_x11_error(struct mucrop_core *core)
 	core->state_flags |= MU_QUIT;
 }
 
-static void usage(bool err)
+static void batch_expose(struct mucrop_batch *batch, xcb_expose_event_t *ev)
 {
-	fputs("usage: mucrop <src_filename> [dst_filename]\n", err ? stderr : stdout);
+	xcb_expose_event_t *d = &batch->expose;
+	int32_t x1, y1;
+
+	if (!batch->has_expose) {
+		*d = *ev;
+		batch->has_expose = true;
+		return;
+	}
+
+	x1 = d->x + d->width > ev->x + ev->width ? d->x + d->width : ev->x + ev->width;
+	y1 = d->y + d->height > ev->y + ev->height ? d->y + d->height : ev->y + ev->height;
+	d->x = d->x < ev->x ? d->x : ev->x;
+	d->y = d->y < ev->y ? d->y : ev->y;
+	d->width = x1 - d->x;
+	d->height = y1 - d->y;
 }
 
-int main(int argc, const char *argv[])
+static void render_batch(struct mucrop_core *core, struct mucrop_batch *batch)
 {
-	struct mucrop_core core = {};
-	xcb_generic_event_t *ev;
-	const char *src_filename = argv[1];
-	const char *dst_filename;
-	struct timespec tp;
-	int ret = 0;
+	if (batch->has_expose)
+		handle_expose(&core->errlist, core->window, core->width, core->height, &batch->expose);
+	if (batch->has_motion)
+		handle_mouse_motion(core, &core->bound_origin, &batch->motion);
+
+	batch->has_expose = false;
+	batch->has_motion = false;
+}
 
-	switch (argc) {
-		case 2:
-			dst_filename = src_filename;
+/*
+ * Dispatches one event. Motion and expose are only recorded in the batch;
+ * button events flush a pending motion first so the drag stays in order.
+ */
+static int handle_event(struct mucrop_core *core, struct mucrop_batch *batch, xcb_generic_event_t *ev)
+{
+	size_t sizes[4] = { core->width, core->height, core->o_width, core->o_height };
+	int ret;
+
+	switch (ev->response_type & ~0x80) {
+		case XCB_KEY_PRESS:
+			if (handle_keypress(core, (xcb_key_press_event_t *)ev) < 0)
+				return -1;
+			break;
+		case XCB_BUTTON_PRESS:
+			render_batch(core, batch);
+			if (handle_buttonpress(core, (xcb_button_press_event_t *)ev) < 0)
+				return -1;
+			break;
+		case XCB_BUTTON_RELEASE:
+			render_batch(core, batch);
+			if (((xcb_button_release_event_t *)ev)->detail == 0x02)
+				core->state_flags &= ~MU_PAN;
+			if ((core->state_flags & MU_COMP) && ((xcb_button_release_event_t *)ev)->detail == 0x01) {
+				core->state_flags &= ~MU_COMP;
+				ret = bound_compute(core, &core->bound_origin, (xcb_button_release_event_t *)ev);
+				if (ret > 0) {
+					if (keep_preview(core) != 0)
+						return -1;
+					// The tiles belong to the old view
+					core->state_flags |= MU_CROP;
+					push_step(core);
+					core->zoom = 0;
+					flush_tiles(&core->tiles, core->window->c);
+					if (reload_image(core, MU_QUALITY_FAST) != 0)
+						return -1;
+				} else if (ret < 0)
+					return -1;
+			}
+			break;
+		case XCB_MOTION_NOTIFY:
+			batch->motion = *(xcb_motion_notify_event_t *)ev;
+			batch->has_motion = true;
 			break;
-		case 3:
-			dst_filename = argv[2];
+		case XCB_EXPOSE:
+			batch_expose(batch, (xcb_expose_event_t *)ev);
+			break;
+		case XCB_GE_GENERIC:
+			handle_present_event(core->window, ev);
+			break;
+		case XCB_CONFIGURE_NOTIFY:
+			ret = resize_window(&core->errlist, core->window, sizes, (xcb_configure_notify_event_t *)ev);
+			if (ret < 0) {
+				return -1;
+			} else if (core->zoom > 0) {
+				// Zoom steps are powers of two of the source, so cached tiles stay valid
+				if (compose_view(core) != 0)
+					return -1;
+			} else if (ret) {
+				ret = fit_view(core);
+				if (ret < 0)
+					return -1;
+				else if (ret)
+					break;
+
+				// A server scaled view stands in until the final one is rendered
+				core->state_flags |= MU_RESI;
+				if (!core->render && reload_image(core, MU_QUALITY_FAST) != 0)
+					return -1;
+				if (arm_timer(&core->errlist, &core->loop, MU_RESIZE_DELAY) != 0)
+					return -1;
+			}
+			break;
+			// According to xcb-requests(3), response_type is 0 in error case
+			// Since it never mentions the type for the event, throw a generic error instead.
+		case 0:
+			handle_x11_error(core);
 			break;
 		default:
+			handle_shm_event(core->window, ev);
+			break;
+	}
+
+	return 0;
+}
+
+// Reports why a file of the session cannot be shown and forgets the errors
+static void skip_file(const char *filename, struct mu_error *list)
+{
+	fprintf(stderr, "mucrop: skipping %s\n", filename);
+	report_errors(list);
+	clear_errors(list);
+}
+
+/*
+ * Shows the current file, from the prefetched decode if there is one. Returns
+ * 1 if the file cannot be read, after reporting why.
+ */
+static int show_file(struct mucrop_core *core)
+{
+	struct mu_prefetch *pf = &core->prefetch;
+	struct mu_result res;
+	int ret;
+
+	if (pf->master && pf->index == core->index) {
+		// The prefetch already tried this file, reading it again would fail the same way
+		if (finish_prefetch(pf) != 0) {
+			skip_file(core->src_filename, pf->errlist);
+			discard_prefetch(pf);
+			return 1;
+		}
+
+		// The old master goes away with the prefetch
+		MagickWand *master = core->master;
+
+		core->master = pf->master;
+		pf->master = master;
+		core->o_width  = pf->width;
+		core->o_height = pf->height;
+		core->tiled = pf->tiled;
+		core->nframes = pf->nframes;
+		core->pyramid = pf->pyramid;
+		memset(&pf->pyramid, 0, sizeof(struct mu_pyramid));
+		res = pf->res;
+		pf->res.image = NULL;
+		discard_prefetch(pf);
+
+		return show_result(core, &res);
+	}
+
+	discard_prefetch(pf);
+	ret = ping_image(core, core->src_filename);
+	if (ret == 0)
+		ret = read_image(core, core->src_filename);
+	else
+		ret = 1;
+	if (ret > 0) {
+		skip_file(core->src_filename, core->errlist);
+		destroy_pyramid(&core->pyramid);
+		ClearMagickWand(core->master);
+	}
+
+	return ret;
+}
+
+/*
+ * Shows the current file of the session, starts rendering it and prefetches
+ * the one after it. Files that cannot be read are skipped in the direction of
+ * travel; returns 1 if that runs off the end of the session.
+ */
+static int open_image(struct mucrop_core *core)
+{
+	struct mu_prefetch *pf = &core->prefetch;
+	size_t width, height, next;
+	int ret;
+
+	for (;;) {
+		core->src_filename = core->files[core->index];
+		// A file coming back round must be read as saved
+		core->save_ret |= wait_saves(&core->saves, core->src_filename);
+		push_step(core);
+
+		ret = show_file(core);
+		if (ret <= 0)
+			break;
+		core->nsteps = 0;
+		// Stepping back from the first file wraps around to a huge index
+		if (core->index + core->direction >= core->nfiles)
+			return 1;
+		core->index += core->direction;
+	}
+	if (ret != 0)
+		return ret;
+
+	ret = start_worker(&core->errlist, &core->worker, &core->pyramid, &core->pool, &core->loop);
+	if (ret != 0)
+		return ret;
+	reload_image(core, MU_QUALITY_FINAL);
+
+	preview_bounds(core, &width, &height);
+	next = core->index + core->direction;
+	if (next < core->nfiles && !is_saving(core->saves, core->files[next]))
+		return start_prefetch(&core->errlist, pf, &core->pool, core->files[next], next, width, height);
+
+	return 0;
+}
+
+// Stops rendering the current file, saves it if asked to and resets the per-image state
+static int close_image(struct mucrop_core *core)
+{
+	int ret = 0;
+
+	stop_worker(&core->worker);
+	if (core->worker.errlist) {
+		ret = process_errors(core->worker.errlist);
+		free_errlist(&core->worker.errlist);
+	}
+
+	if (core->state_flags & MU_SAVE)
+		crop_image(core, core->dst_filename ? core->dst_filename : core->src_filename);
+
+	disarm_timer(&core->loop);
+	flush_tiles(&core->tiles, core->window->c);
+	flush_tiles(&core->previews, core->window->c);
+	core->nsteps = 0;
+	destroy_pyramid(&core->pyramid);
+	ClearMagickWand(core->master);
+
+	core->zoom = 0;
+	core->pan_x = 0;
+	core->pan_y = 0;
+	core->state_flags &= ~(MU_COMP | MU_CROP | MU_RESI | MU_SAVE | MU_UNDO | MU_PAN | MU_NEXT | MU_PREV);
+
+	return ret;
+}
+
+// Runs the event loop until the current image is left
+static int run_image(struct mucrop_core *core)
+{
+	struct mucrop_batch batch = {};
+	xcb_generic_event_t *ev;
+	struct mu_span span;
+	int ret;
+
+	while (!(core->state_flags & MU_LEAVE)) {
+		ev = xcb_poll_for_event(core->window->c);
+		if (!ev) {
+			int events;
+
+			// Everything handled so far goes out as one frame, or waits for the one in flight
+			present_frame(&core->errlist, core->window);
+			xcb_flush(core->window->c);
+
+			if (xcb_connection_has_error(core->window->c)) {
+				handle_x11_error(core);
+				break;
+			}
+
+			events = wait_loop(&core->errlist, &core->loop);
+			if (events < 0)
+				return events;
+			if ((events & MU_LOOP_TIMER) && (core->state_flags & MU_RESI)) {
+				core->state_flags &= ~MU_RESI;
+				reload_image(core, MU_QUALITY_FINAL);
+			}
+			if (events & MU_LOOP_WAKE) {
+				struct mu_result res;
+				bool tiles = false;
+
+				while (take_result(&core->worker, &res)) {
+					enum mu_quality quality = res.job.quality;
+
+					if (res.job.kind == MU_JOB_TILE) {
+						tiles = true;
+						ret = show_tile(core, &res);
+					} else if (res.ret == 0 && res.job.generation != core->worker.generation) {
+						// Finished just before cancel_job(); only this thread bumps the generation
+						release_buffer(&core->pool, res.image);
+						continue;
+					} else {
+						ret = show_result(core, &res);
+						// A pending resize refines on its timer instead
+						if (ret == 0 && core->zoom == 0 && quality == MU_QUALITY_FAST && !(core->state_flags & MU_RESI))
+							reload_image(core, MU_QUALITY_FINAL);
+					}
+					if (ret != 0)
+						return -1;
+				}
+				if (tiles && core->zoom > 0 && compose_view(core) != 0)
+					return -1;
+				trace_counters();
+
+				span_begin(&span, "flush");
+				xcb_flush(core->window->c);
+				span_end(&span);
+			}
+			continue;
+		}
+
+		// Drain everything already queued before rendering once
+		do {
+			span_begin(&span, "handle_event");
+			ret = handle_event(core, &batch, ev);
+			span_end(&span);
+			free(ev);
+			if (ret != 0)
+				return ret;
+		} while (!(core->state_flags & MU_LEAVE) && (ev = xcb_poll_for_event(core->window->c)) != NULL);
+
+		span_begin(&span, "render_batch");
+		render_batch(core, &batch);
+		span_end(&span);
+
+		span_begin(&span, "flush");
+		xcb_flush(core->window->c);
+		span_end(&span);
+	}
+
+	return 0;
+}
+
+static bool is_image_filename(const char *filename)
+{
+	static const char *exts[] = {
+		"avif", "bmp", "gif", "heic", "jpeg", "jpg", "jxl", "pbm", "pgm", "png",
+		"pnm", "ppm", "tga", "tif", "tiff", "webp"
+	};
+	const char *ext = strrchr(filename, '.');
+
+	if (ext == NULL)
+		return false;
+	for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+		if (strcasecmp(ext + 1, exts[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int add_file(struct mucrop_core *core, size_t *alloc, char *filename)
+{
+	if (filename == NULL)
+		MU_RET_ERRNO(&core->errlist, ENOMEM);
+
+	if (core->nfiles == *alloc) {
+		char **files = realloc_array(core->files, *alloc ? *alloc * 2 : 16, sizeof(char *));
+
+		if (files == NULL) {
+			free(filename);
+			MU_RET_ERRNO(&core->errlist, ENOMEM);
+		}
+		core->files = files;
+		*alloc = *alloc ? *alloc * 2 : 16;
+	}
+	core->files[core->nfiles++] = filename;
+
+	return 0;
+}
+
+// Adds the images of a directory in name order
+static int add_directory(struct mucrop_core *core, size_t *alloc, const char *dirname)
+{
+	size_t first = core->nfiles;
+	struct dirent *ent;
+	DIR *dir;
+	int ret = 0;
+
+	dir = opendir(dirname);
+	if (dir == NULL) {
+		MU_PUSH_ERRF(&core->errlist, "Could not open %s: %s", dirname, strerror(errno));
+		return -1;
+	}
+
+	while (ret == 0 && (ent = readdir(dir)) != NULL) {
+		char *path;
+
+		if (ent->d_name[0] == '.' || !is_image_filename(ent->d_name))
+			continue;
+		path = malloc(strlen(dirname) + strlen(ent->d_name) + 2);
+		if (path)
+			sprintf(path, "%s/%s", dirname, ent->d_name);
+		ret = add_file(core, alloc, path);
+	}
+	closedir(dir);
+
+	qsort(core->files + first, core->nfiles - first, sizeof(char *), compare_names);
+
+	return ret;
+}
+
+/*
+ * Collects the session's files. Directories expand to the images in them, and
+ * every file is saved in place.
+ */
+static int collect_files(struct mucrop_core *core, char **args, size_t nargs)
+{
+	size_t alloc = 0;
+	struct stat st;
+	int ret = 0;
+
+	for (size_t i = 0; ret == 0 && i < nargs; i++) {
+		if (stat(args[i], &st) == 0 && S_ISDIR(st.st_mode))
+			ret = add_directory(core, &alloc, args[i]);
+		else
+			ret = add_file(core, &alloc, strdup(args[i]));
+	}
+	if (ret == 0 && core->nfiles == 0)
+		MU_RET_ERRSTR(&core->errlist, "No images to crop");
+
+	return ret;
+}
+
+static void free_files(struct mucrop_core *core)
+{
+	for (size_t i = 0; i < core->nfiles; i++)
+		free(core->files[i]);
+	free(core->files);
+	core->files = NULL;
+	core->nfiles = 0;
+}
+
+static void usage(bool err)
+{
+	fputs("usage: mucrop [-lwx] [-m size] [-d size] [-t trace] <src_filename> [dst_filename]\n"
+	      "       mucrop [-lwx] [-m size] [-d size] [-t trace] -o dst_filename <src_filename>\n"
+	      "       mucrop [-lswx] [-m size] [-d size] [-t trace] <file|directory>...\n"
+	      "       mucrop --batch [-l] [-j jobs] [-m size] [-d size] [-t trace] [manifest]\n", err ? stderr : stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct mucrop_core core = { .loop = { -1, -1, -1 }, .direction = 1 };
+	bool single = false;
+	const char *trace_filename = getenv("MUCROP_TRACE");
+	const char *memory_limit = getenv("MUCROP_MEMORY_LIMIT");
+	const char *disk_limit = getenv("MUCROP_DISK_LIMIT");
+	const struct option longopts[] = {
+		{ "batch", no_argument,       NULL, 'b' },
+		{ "disk-limit", required_argument, NULL, 'd' },
+		{ "help",  no_argument,       NULL, 'h' },
+		{ "jobs",  required_argument, NULL, 'j' },
+		{ "memory-limit", required_argument, NULL, 'm' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "session", no_argument,     NULL, 's' },
+		{ "trace", required_argument, NULL, 't' },
+		{ "wait",  no_argument,       NULL, 'w' },
+		{ "xrender", no_argument,     NULL, 'x' },
+		{ NULL, 0, NULL, 0 }
+	};
+	bool batch_mode = false;
+	bool session = false;
+	size_t nthreads = 0;
+	size_t memory = 0, disk = 0;
+	char *end;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "bd:hj:lm:o:st:wx", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'b':
+				batch_mode = true;
+				break;
+			case 'd':
+				disk_limit = optarg;
+				break;
+			case 'h':
+				usage(false);
+				return 0;
+			case 'j':
+				errno = 0;
+				nthreads = strtoul(optarg, &end, 10);
+				if (errno != 0 || end == optarg || *end != '\0' || *optarg == '-' || nthreads == 0) {
+					fputs("mucrop: jobs must be a positive number\n", stderr);
+					usage(true);
+					return EX_USAGE;
+				}
+				break;
+			case 'l':
+				core.jpeg_snap = true;
+				break;
+			case 'm':
+				memory_limit = optarg;
+				break;
+			case 'o':
+				core.dst_filename = optarg;
+				break;
+			case 's':
+				session = true;
+				break;
+			case 't':
+				trace_filename = optarg;
+				break;
+			case 'w':
+				core.wait = true;
+				break;
+			case 'x':
+				core.render = true;
+				break;
+			default:
+				usage(true);
+				return EX_USAGE;
+		}
+	}
+
+	if ((memory_limit && *memory_limit && parse_size(memory_limit, &memory) != 0) ||
+			(disk_limit && *disk_limit && parse_size(disk_limit, &disk) != 0)) {
+		fputs("mucrop: limits are sizes in bytes, optionally followed by K, M, G or T\n", stderr);
+		usage(true);
+		return EX_USAGE;
+	}
+
+	// Only a batch runs on several threads
+	if (nthreads > 0 && !batch_mode) {
+		fputs("mucrop: -j only applies to --batch\n", stderr);
+		usage(true);
+		return EX_USAGE;
+	}
+
+	if (batch_mode) {
+		if (argc - optind > 1 || core.dst_filename) {
 			usage(true);
 			return EX_USAGE;
+		}
+
+		MagickWandGenesis();
+		core.errlist = create_errlist(3);
+		if (core.errlist == NULL) {
+			perror("malloc");
+			MagickWandTerminus();
+			return EX_OSERR;
+		}
+		ret = init_budget(&core.errlist, &core.budget, memory, disk);
+		if (ret == 0 && trace_filename && *trace_filename)
+			ret = trace_open(&core.errlist, trace_filename);
+		if (ret == 0)
+			ret = run_batch(&core.errlist, optind < argc ? argv[optind] : "-", nthreads, core.jpeg_snap);
+		trace_close();
+		ret |= process_errors(core.errlist);
+		free_errlist(&core.errlist);
+		MagickWandTerminus();
+
+		return ret < 0 ? EX_SOFTWARE : 0;
+	}
+
+	if (optind == argc) {
+		usage(true);
+		return EX_USAGE;
+	}
+	/*
+	 * Two plain files are a source and a destination, as is one file with
+	 * -o. A directory, three or more paths, or -s make a session.
+	 */
+	if (core.dst_filename) {
+		if (argc - optind != 1 || session) {
+			usage(true);
+			return EX_USAGE;
+		}
+		single = true;
+	} else if (argc - optind == 2 && !session) {
+		struct stat st;
+
+		single = !(stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode)) &&
+			!(stat(argv[optind + 1], &st) == 0 && S_ISDIR(st.st_mode));
+		if (single)
+			core.dst_filename = argv[optind + 1];
 	}
 
+	core.tiles.budget = MU_TILE_BUDGET;
+	core.previews.budget = MU_UNDO_BUDGET;
+	init_pool(&core.pool);
+
 	MagickWandGenesis();
 	core.wand = NewMagickWand();
+	core.master = NewMagickWand();
 
 	core.errlist = create_errlist(3);
 	if (core.errlist == NULL) {
@@ -328,9 +1371,37 @@ int main(int argc, const char *argv[])
 		goto fail;
 	}
 
-	ret = ping_image(&core, src_filename);
-	if (ret != 0) {
+	// mucrop's caches get their share of the memory limit, ImageMagick the rest
+	ret = init_budget(&core.errlist, &core.budget, memory, disk);
+	if (ret != 0)
 		goto fail;
+	if (core.budget.memory > 0) {
+		if (core.budget.tiles < core.tiles.budget)
+			core.tiles.budget = core.budget.tiles;
+		if (core.budget.undo < core.previews.budget)
+			core.previews.budget = core.budget.undo;
+	}
+	core.pool.heap_limit = core.budget.pixels;
+	core.pool.spill_limit = core.budget.scratch;
+
+	if (trace_filename && *trace_filename) {
+		ret = trace_open(&core.errlist, trace_filename);
+		if (ret != 0)
+			goto fail;
+	}
+
+	ret = collect_files(&core, argv + optind, single ? 1 : argc - optind);
+	if (ret != 0)
+		goto fail;
+
+	// The window is sized for the first readable image and kept for the rest
+	while (ping_image(&core, core.files[core.index]) != 0) {
+		skip_file(core.files[core.index], core.errlist);
+		if (++core.index == core.nfiles) {
+			MU_PUSH_ERRSTR(&core.errlist, "No readable images to crop");
+			ret = -1;
+			goto fail;
+		}
 	}
 
 	core.window = create_window(&core.errlist, core.o_width, core.o_height);
@@ -340,94 +1411,76 @@ int main(int argc, const char *argv[])
 	}
 	core.width = core.window->width;
 	core.height = core.window->height;
+	if (core.render && !core.window->render.available) {
+		fputs("mucrop: XRender is not available, scaling on the client\n", stderr);
+		core.render = false;
+	}
 
 	create_pixmap(&core.errlist, core.window, core.width, core.height);
 	create_gc(&core.errlist, core.window);
 
-	ret = read_image(&core, src_filename);
+	ret = init_loop(&core.errlist, &core.loop, core.window->c);
 	if (ret != 0)
 		goto fail;
 
-	load_image(&core.errlist, core.window, core.image, core.length, core.width, core.height);
+	ret = open_image(&core);
+	if (ret > 0)
+		MU_PUSH_ERRSTR(&core.errlist, "No readable images to crop");
+	if (ret != 0)
+		goto fail;
 
 	map_window(core.window);
 
-	core.state_flags |= MU_WAIT;
-	while (!(core.state_flags & MU_QUIT)) {
-		size_t sizes[4] = { core.width, core.height, core.o_width, core.o_height };
-		if (core.state_flags & MU_WAIT) {
-			ev = xcb_wait_for_event(core.window->c);
-		} else {
-			ev = xcb_poll_for_event(core.window->c);
-		}
-		if (!ev) {
-			struct timespec now;
-			if (core.state_flags & MU_RESI) {
-				clock_gettime(CLOCK_MONOTONIC, &now);
-				if (difftimespec(&now, &tp) > 500) {
-					if (reload_image(&core, src_filename) != 0)
-						goto fail;
-					core.state_flags |= MU_WAIT;
-					core.state_flags &= ~MU_RESI;
-				}
-			}
-			continue;
-		}
-		switch (ev->response_type & ~0x80) {
-			case XCB_KEY_PRESS:
-				handle_keypress(&core, (xcb_key_press_event_t *)ev);
-				break;
-			case XCB_BUTTON_PRESS:
-				handle_buttonpress(&core, (xcb_button_press_event_t *)ev);
-				break;
-			case XCB_BUTTON_RELEASE:
-				if (core.state_flags & MU_COMP) {
-					core.state_flags &= ~MU_COMP;
-					ret = bound_compute(&core, &core.bound_origin, (xcb_button_release_event_t *)ev);
-					if (ret > 0) {
-						core.state_flags |= MU_CROP;
-						if (reload_image(&core, src_filename) != 0)
-							goto fail;
-					} else if (ret < 0)
-						goto fail;
-				}
-				break;
-			case XCB_MOTION_NOTIFY:
-				handle_mouse_motion(&core, &core.bound_origin, (xcb_motion_notify_event_t *)ev);
-				break;
-			case XCB_EXPOSE:
-				handle_expose(&core.errlist, core.window, core.width, core.height, (xcb_expose_event_t *)ev);
-				break;
-			case XCB_CONFIGURE_NOTIFY:
-				if (resize_window(&core.errlist, core.window, sizes, (xcb_configure_notify_event_t *)ev)) {
-					core.state_flags &= ~MU_WAIT;
-					core.state_flags |= MU_RESI;
-					clock_gettime(CLOCK_MONOTONIC, &tp);
-				}
-				break;
-				// According to xcb-requests(3), response_type is 0 in error case
-				// Since it never mentions the type for the event, throw a generic error instead.
-			case 0:
-				handle_x11_error(&core);
-				break;
-			default:
-				break;
+	for (;;) {
+		uint16_t leave;
+
+		ret = run_image(&core);
+		if (ret != 0)
+			goto fail;
+
+		leave = core.state_flags & (MU_NEXT | MU_PREV);
+		ret = close_image(&core);
+		if (ret != 0 || !leave)
+			break;
+
+		core.direction = leave & MU_NEXT ? 1 : -1;
+		core.index += core.direction;
+		// Past the last readable file the session is over
+		ret = open_image(&core);
+		if (ret > 0) {
+			ret = 0;
+			break;
 		}
-		free(ev);
+		if (ret != 0)
+			goto fail;
 	}
 
-	if (core.state_flags & MU_SAVE) {
-		crop_image(&core, src_filename, dst_filename);
+fail:
+	stop_worker(&core.worker);
+	discard_prefetch(&core.prefetch);
+	destroy_loop(&core.loop);
+	if (core.window) {
+		flush_tiles(&core.tiles, core.window->c);
+		flush_tiles(&core.previews, core.window->c);
+		destroy_window(&core.window);
 	}
 
-fail:
+	// The window is gone by now, only the saves are left to finish
+	ret |= core.save_ret | wait_saves(&core.saves, NULL);
+	trace_close();
 	ret |= process_errors(core.errlist);
 	free_errlist(&core.errlist);
-	if (core.window) {
-		destroy_window(&core.window);
+	if (core.worker.errlist) {
+		ret |= process_errors(core.worker.errlist);
+		free_errlist(&core.worker.errlist);
 	}
 
-	/* MagickRelinquishMemory(core.image); */
+	destroy_pyramid(&core.pyramid);
+	destroy_pool(&core.pool);
+	free_files(&core);
+	if (core.master) {
+		core.master = DestroyMagickWand(core.master);
+	}
 	if (core.wand) {
 		ClearMagickWand(core.wand);
 		core.wand = DestroyMagickWand(core.wand);
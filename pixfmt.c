@@ -0,0 +1,141 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <xcb/xcb.h>
+
+#include "pixfmt.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MU_HOST_ORDER XCB_IMAGE_ORDER_MSB_FIRST
+#else
+#define MU_HOST_ORDER XCB_IMAGE_ORDER_LSB_FIRST
+#endif
+
+#define EXPAND10(v) ((uint32_t)(v) << 2 | (uint32_t)(v) >> 6)
+
+#define PACK_X8R8G8B8(r, g, b)    ((uint32_t)(r) << 16 | (uint32_t)(g) << 8 | (uint32_t)(b))
+#define PACK_X8B8G8R8(r, g, b)    ((uint32_t)(b) << 16 | (uint32_t)(g) << 8 | (uint32_t)(r))
+#define PACK_X2R10G10B10(r, g, b) (EXPAND10(r) << 20 | EXPAND10(g) << 10 | EXPAND10(b))
+#define PACK_X2B10G10R10(r, g, b) (EXPAND10(b) << 20 | EXPAND10(g) << 10 | EXPAND10(r))
+#define PACK_R5G6B5(r, g, b)      (uint16_t)(((r) & 0xf8) << 8 | ((g) & 0xfc) << 3 | (b) >> 3)
+#define PACK_X1R5G5B5(r, g, b)    (uint16_t)(((r) & 0xf8) << 7 | ((g) & 0xf8) << 2 | (b) >> 3)
+
+#define SAME(v) (v)
+
+/*
+ * Generates a one-pass kernel from BGRA to a packed native pixel. pack builds
+ * the pixel in host order, swap turns it into the server's byte order.
+ */
+#define MU_CONVERT_KERNEL(name, type, pack, swap) \
+static void name(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t stride) \
+{ \
+	for (size_t y = 0; y < height; y++) { \
+		const unsigned char *s = src + y * width * 4; \
+		type *d = (type *)(dst + y * stride); \
+		for (size_t x = 0; x < width; x++, s += 4) \
+			d[x] = swap(pack(s[2], s[1], s[0])); \
+	} \
+}
+
+MU_CONVERT_KERNEL(convert_x8r8g8b8, uint32_t, PACK_X8R8G8B8, SAME)
+MU_CONVERT_KERNEL(convert_x8r8g8b8_swap, uint32_t, PACK_X8R8G8B8, __builtin_bswap32)
+MU_CONVERT_KERNEL(convert_x8b8g8r8, uint32_t, PACK_X8B8G8R8, SAME)
+MU_CONVERT_KERNEL(convert_x8b8g8r8_swap, uint32_t, PACK_X8B8G8R8, __builtin_bswap32)
+MU_CONVERT_KERNEL(convert_x2r10g10b10, uint32_t, PACK_X2R10G10B10, SAME)
+MU_CONVERT_KERNEL(convert_x2r10g10b10_swap, uint32_t, PACK_X2R10G10B10, __builtin_bswap32)
+MU_CONVERT_KERNEL(convert_x2b10g10r10, uint32_t, PACK_X2B10G10R10, SAME)
+MU_CONVERT_KERNEL(convert_x2b10g10r10_swap, uint32_t, PACK_X2B10G10R10, __builtin_bswap32)
+MU_CONVERT_KERNEL(convert_r5g6b5, uint16_t, PACK_R5G6B5, SAME)
+MU_CONVERT_KERNEL(convert_r5g6b5_swap, uint16_t, PACK_R5G6B5, __builtin_bswap16)
+MU_CONVERT_KERNEL(convert_x1r5g5b5, uint16_t, PACK_X1R5G5B5, SAME)
+MU_CONVERT_KERNEL(convert_x1r5g5b5_swap, uint16_t, PACK_X1R5G5B5, __builtin_bswap16)
+
+struct mu_kernel {
+	uint8_t bpp;
+	uint32_t red_mask;
+	uint32_t green_mask;
+	uint32_t blue_mask;
+	mu_convert_fn native;
+	mu_convert_fn swapped;
+};
+
+static const struct mu_kernel kernels[] = {
+	{ 32, 0xff0000,   0x00ff00, 0x0000ff,   convert_x8r8g8b8,    convert_x8r8g8b8_swap },
+	{ 32, 0x0000ff,   0x00ff00, 0xff0000,   convert_x8b8g8r8,    convert_x8b8g8r8_swap },
+	{ 32, 0x3ff00000, 0x000ffc00, 0x000003ff, convert_x2r10g10b10, convert_x2r10g10b10_swap },
+	{ 32, 0x000003ff, 0x000ffc00, 0x3ff00000, convert_x2b10g10r10, convert_x2b10g10r10_swap },
+	{ 16, 0xf800,     0x07e0,   0x001f,     convert_r5g6b5,      convert_r5g6b5_swap },
+	{ 16, 0x7c00,     0x03e0,   0x001f,     convert_x1r5g5b5,    convert_x1r5g5b5_swap },
+};
+
+static const xcb_visualtype_t *find_visual(xcb_screen_t *screen, xcb_visualid_t id)
+{
+	xcb_depth_iterator_t depths = xcb_screen_allowed_depths_iterator(screen);
+
+	for (; depths.rem; xcb_depth_next(&depths)) {
+		xcb_visualtype_iterator_t visuals = xcb_depth_visuals_iterator(depths.data);
+
+		for (; visuals.rem; xcb_visualtype_next(&visuals)) {
+			if (visuals.data->visual_id == id)
+				return visuals.data;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Picks the conversion for the root visual. Layouts without a kernel keep the
+ * BGRA upload, which is what they got before.
+ */
+void init_pixfmt(struct mu_pixfmt *fmt, const xcb_setup_t *setup, xcb_screen_t *screen)
+{
+	xcb_format_iterator_t formats = xcb_setup_pixmap_formats_iterator(setup);
+	const xcb_visualtype_t *visual = find_visual(screen, screen->root_visual);
+	bool swap = setup->image_byte_order != MU_HOST_ORDER;
+
+	memset(fmt, 0, sizeof(struct mu_pixfmt));
+	fmt->depth = screen->root_depth;
+	fmt->bpp = 32;
+	fmt->pad = 32;
+	fmt->byte_order = setup->image_byte_order;
+
+	for (; formats.rem; xcb_format_next(&formats)) {
+		if (formats.data->depth == fmt->depth) {
+			fmt->bpp = formats.data->bits_per_pixel;
+			fmt->pad = formats.data->scanline_pad;
+			break;
+		}
+	}
+
+	if (visual == NULL || (visual->_class != XCB_VISUAL_CLASS_TRUE_COLOR &&
+				visual->_class != XCB_VISUAL_CLASS_DIRECT_COLOR))
+		return;
+	fmt->red_mask = visual->red_mask;
+	fmt->green_mask = visual->green_mask;
+	fmt->blue_mask = visual->blue_mask;
+
+	// BGRA bytes are x8r8g8b8 in LSB first order, so that needs no pass at all
+	if (fmt->bpp == 32 && fmt->red_mask == 0xff0000 && fmt->green_mask == 0xff00 && fmt->blue_mask == 0xff &&
+			fmt->byte_order == XCB_IMAGE_ORDER_LSB_FIRST)
+		return;
+
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		const struct mu_kernel *k = kernels + i;
+
+		if (k->bpp != fmt->bpp || k->red_mask != fmt->red_mask ||
+				k->green_mask != fmt->green_mask || k->blue_mask != fmt->blue_mask)
+			continue;
+		fmt->convert = swap ? k->swapped : k->native;
+		break;
+	}
+}
+
+// Bytes per row of a width pixel wide ZPixmap in this format
+size_t pixfmt_stride(const struct mu_pixfmt *fmt, size_t width)
+{
+	size_t bits = width * fmt->bpp;
+
+	return (bits + fmt->pad - 1) / fmt->pad * fmt->pad / 8;
+}
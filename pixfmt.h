@@ -0,0 +1,31 @@
+#ifndef MU_PIXFMT_H
+#define MU_PIXFMT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <xcb/xcb.h>
+
+typedef void (*mu_convert_fn)(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t stride);
+
+/*
+ * The server's ZPixmap layout for the root visual, and the kernel that writes
+ * BGRA into it. convert is NULL when BGRA already is the native layout.
+ */
+struct mu_pixfmt {
+	uint8_t depth;
+	uint8_t bpp;
+	uint8_t pad;
+	uint8_t byte_order;
+
+	uint32_t red_mask;
+	uint32_t green_mask;
+	uint32_t blue_mask;
+
+	mu_convert_fn convert;
+};
+
+extern void init_pixfmt(struct mu_pixfmt *fmt, const xcb_setup_t *setup, xcb_screen_t *screen);
+extern size_t pixfmt_stride(const struct mu_pixfmt *fmt, size_t width);
+
+#endif
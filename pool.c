@@ -0,0 +1,107 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "budget.h"
+#include "pool.h"
+
+void init_pool(struct mu_pool *pool)
+{
+	memset(pool, 0, sizeof(struct mu_pool));
+	pthread_mutex_init(&pool->lock, NULL);
+}
+
+static void free_buffer(struct mu_pool *pool, struct mu_buffer *buf)
+{
+	if (buf->data == NULL)
+		return;
+
+	if (buf->mapped) {
+		unmap_scratch(buf->data, buf->size);
+		pool->spilled -= buf->size;
+	} else {
+		free(buf->data);
+		pool->heap -= buf->size;
+	}
+	buf->data = NULL;
+	buf->size = 0;
+	buf->mapped = false;
+}
+
+// Allocates on the heap while that stays within its limit, else in a scratch file
+static void alloc_buffer(struct mu_pool *pool, struct mu_buffer *buf, size_t size)
+{
+	if (pool->heap_limit == 0 || pool->heap + size <= pool->heap_limit) {
+		buf->data = malloc(size);
+		buf->mapped = false;
+		if (buf->data)
+			pool->heap += size;
+	} else if (pool->spill_limit == 0 || pool->spilled + size <= pool->spill_limit) {
+		buf->data = map_scratch(size);
+		buf->mapped = true;
+		if (buf->data)
+			pool->spilled += size;
+	}
+	buf->size = buf->data ? size : 0;
+}
+
+void destroy_pool(struct mu_pool *pool)
+{
+	for (size_t i = 0; i < MU_POOL_BUFFERS; i++)
+		free_buffer(pool, pool->buffers + i);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Returns a buffer of at least size bytes, or NULL if the pool is exhausted or
+ * out of memory and disk. Prefers the smallest free buffer that fits, else regrows the
+ * largest free one.
+ */
+unsigned char *acquire_buffer(struct mu_pool *pool, size_t size)
+{
+	struct mu_buffer *fit = NULL, *grow = NULL;
+	unsigned char *data = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	for (size_t i = 0; i < MU_POOL_BUFFERS; i++) {
+		struct mu_buffer *buf = pool->buffers + i;
+
+		if (buf->used)
+			continue;
+		if (buf->size >= size && (fit == NULL || buf->size < fit->size))
+			fit = buf;
+		if (grow == NULL || buf->size > grow->size)
+			grow = buf;
+	}
+
+	if (fit == NULL && grow != NULL) {
+		// The old contents are dead, so skip the copy realloc would do
+		free_buffer(pool, grow);
+		alloc_buffer(pool, grow, size);
+		if (grow->data)
+			fit = grow;
+	}
+
+	if (fit) {
+		fit->used = true;
+		data = fit->data;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return data;
+}
+
+void release_buffer(struct mu_pool *pool, unsigned char *data)
+{
+	if (data == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	for (size_t i = 0; i < MU_POOL_BUFFERS; i++) {
+		if (pool->buffers[i].data == data) {
+			pool->buffers[i].used = false;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
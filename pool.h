@@ -0,0 +1,41 @@
+#ifndef MU_POOL_H
+#define MU_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Enough for every result the worker can queue, plus the ones in flight and a prefetch
+#define MU_POOL_BUFFERS 11
+
+struct mu_buffer {
+	unsigned char *data;
+	size_t size;
+	bool used;
+	bool mapped;
+};
+
+/*
+ * Pixel buffers shared by the worker and the UI thread. Buffers are kept
+ * around once released and handed out again by best fit, so rendering
+ * previews of a stable size stops allocating after the first few.
+ * Buffers live on the heap up to heap_limit bytes and in scratch files
+ * (up to spill_limit) past it; 0 means no limit.
+ */
+struct mu_pool {
+	pthread_mutex_t lock;
+	struct mu_buffer buffers[MU_POOL_BUFFERS];
+
+	size_t heap;
+	size_t heap_limit;
+	size_t spilled;
+	size_t spill_limit;
+};
+
+extern void init_pool(struct mu_pool *pool);
+extern void destroy_pool(struct mu_pool *pool);
+
+extern unsigned char *acquire_buffer(struct mu_pool *pool, size_t size);
+extern void release_buffer(struct mu_pool *pool, unsigned char *data);
+
+#endif
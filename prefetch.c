@@ -0,0 +1,129 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "pool.h"
+#include "prefetch.h"
+#include "pyramid.h"
+#include "tiled.h"
+#include "window.h"
+#include "worker.h"
+#include "util/error.h"
+#include "util/wand.h"
+
+// Lets discard_prefetch() stop a decode halfway
+static MagickBooleanType prefetch_monitor(const char *text, const MagickOffsetType offset, const MagickSizeType span, void *data)
+{
+	struct mu_prefetch *pf = data;
+
+	return __atomic_load_n(&pf->cancel, __ATOMIC_RELAXED) ? MagickFalse : MagickTrue;
+}
+
+static void *prefetch_main(void *data)
+{
+	struct mu_prefetch *pf = data;
+	struct mu_job job = { .kind = MU_JOB_PREVIEW, .quality = MU_QUALITY_FAST };
+
+	pf->ret = -1;
+	MagickSetProgressMonitor(pf->master, prefetch_monitor, pf);
+
+	if (MagickPingImage(pf->master, pf->filename) == MagickFalse) {
+		RaiseWandException(pf->master, &pf->errlist);
+		return NULL;
+	}
+	pf->nframes = MagickGetNumberImages(pf->master);
+	MagickResetIterator(pf->master);
+	pf->width  = MagickGetImageWidth(pf->master);
+	pf->height = MagickGetImageHeight(pf->master);
+	pf->tiled  = pf->width * pf->height > MU_TILED_AREA && is_tiff_file(pf->filename);
+	ClearMagickWand(pf->master);
+
+	job.s_width  = job.width  = pf->width;
+	job.s_height = job.height = pf->height;
+	scale_to_window(&job.width, &job.height, pf->w_width, pf->w_height);
+
+	if (pf->tiled) {
+		init_pyramid_tiled(&pf->pyramid, pf->filename, pf->width, pf->height);
+	} else {
+		MagickSetProgressMonitor(pf->master, prefetch_monitor, pf);
+		if (read_pyramid(&pf->errlist, &pf->pyramid, pf->master, pf->filename, pf->nframes,
+					pf->width, pf->height, job.width, job.height) != 0)
+			return NULL;
+		MagickSetProgressMonitor(pf->master, NULL, NULL);
+		// Decoded images keep the monitor, which must not outlive pf
+		for (size_t i = 0; i < pf->pyramid.nlevels; i++) {
+			MagickWand *wand = pf->pyramid.level[i];
+
+			if (wand && MagickGetNumberImages(wand) > 0)
+				MagickSetImageProgressMonitor(wand, NULL, NULL);
+		}
+	}
+
+	pf->ret = render_job(&pf->errlist, &pf->pyramid, pf->pool, &job, &pf->res, NULL, NULL);
+
+	return NULL;
+}
+
+int start_prefetch(struct mu_error **err, struct mu_prefetch *pf, struct mu_pool *pool,
+		const char *filename, size_t index, size_t w_width, size_t w_height)
+{
+	int ret;
+
+	memset(pf, 0, sizeof(struct mu_prefetch));
+	pf->pool = pool;
+	pf->filename = filename;
+	pf->index = index;
+	pf->w_width = w_width;
+	pf->w_height = w_height;
+
+	pf->errlist = create_errlist(1);
+	pf->master = NewMagickWand();
+	if (pf->errlist == NULL || pf->master == NULL) {
+		discard_prefetch(pf);
+		MU_RET_ERRNO(err, ENOMEM);
+	}
+
+	ret = pthread_create(&pf->thread, NULL, prefetch_main, pf);
+	if (ret != 0) {
+		discard_prefetch(pf);
+		MU_RET_ERRNO(err, ret);
+	}
+	pf->started = true;
+
+	return 0;
+}
+
+/*
+ * Waits for the prefetch to finish. On success master, the geometry, the
+ * pyramid and the preview in res are ready to be taken over; errors stay in
+ * pf->errlist.
+ */
+int finish_prefetch(struct mu_prefetch *pf)
+{
+	if (pf->started) {
+		pthread_join(pf->thread, NULL);
+		pf->started = false;
+	}
+
+	return pf->ret;
+}
+
+// Stops the prefetch and frees whatever the caller did not take over
+void discard_prefetch(struct mu_prefetch *pf)
+{
+	__atomic_store_n(&pf->cancel, true, __ATOMIC_RELAXED);
+	finish_prefetch(pf);
+
+	if (pf->res.image) {
+		release_buffer(pf->pool, pf->res.image);
+		pf->res.image = NULL;
+	}
+	destroy_pyramid(&pf->pyramid);
+	if (pf->master)
+		pf->master = DestroyMagickWand(pf->master);
+	if (pf->errlist)
+		free_errlist(&pf->errlist);
+}
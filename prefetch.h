@@ -0,0 +1,48 @@
+#ifndef MU_PREFETCH_H
+#define MU_PREFETCH_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "pool.h"
+#include "pyramid.h"
+#include "worker.h"
+#include "util/error.h"
+
+/*
+ * Pings and decodes one image of a session on a thread of its own and renders
+ * a fast preview of it at window size, so that switching to it only has to
+ * upload the preview. Tiled sources are only pinged, JPEGs only decoded as
+ * far as the preview needs.
+ */
+struct mu_prefetch {
+	pthread_t thread;
+	struct mu_error *errlist;
+	struct mu_pool *pool;
+
+	const char *filename;
+	size_t index;
+	size_t w_width;
+	size_t w_height;
+
+	MagickWand *master;
+	size_t width;
+	size_t height;
+	bool tiled;
+	size_t nframes;
+	struct mu_pyramid pyramid;
+	struct mu_result res;
+	int ret;
+
+	bool started;
+	bool cancel;
+};
+
+extern int start_prefetch(struct mu_error **err, struct mu_prefetch *pf, struct mu_pool *pool,
+		const char *filename, size_t index, size_t w_width, size_t w_height);
+extern int finish_prefetch(struct mu_prefetch *pf);
+extern void discard_prefetch(struct mu_prefetch *pf);
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "jpegcrop.h"
+#include "pyramid.h"
+#include "util/error.h"
+#include "util/wand.h"
+
+void init_pyramid(struct mu_pyramid *pyr, MagickWand *master)
+{
+	destroy_pyramid(pyr);
+
+	pyr->level[0] = master;
+	pyr->width[0] = MagickGetImageWidth(master);
+	pyr->height[0] = MagickGetImageHeight(master);
+	pyr->nlevels = 1;
+}
+
+void init_pyramid_tiled(struct mu_pyramid *pyr, const char *filename, size_t width, size_t height)
+{
+	destroy_pyramid(pyr);
+
+	pyr->width[0] = width;
+	pyr->height[0] = height;
+	pyr->nlevels = 1;
+	pyr->tiled = filename;
+}
+
+/*
+ * Reads filename (width x height) into master and starts pyr from it. When the
+ * decoder can cheaply reduce by a power of two that still covers t_width x
+ * t_height (JPEG DCT scaling), only that reduction is decoded and the master
+ * is left for load_master(). Of sources with several frames only the first
+ * is read.
+ */
+int read_pyramid(struct mu_error **err, struct mu_pyramid *pyr, MagickWand *master, const char *filename,
+		size_t nframes, size_t width, size_t height, size_t t_width, size_t t_height)
+{
+	MagickWand *draft;
+	char geometry[64];
+	char path[4096];
+	unsigned int shift = 0;
+
+	if (nframes > 1) {
+		if (snprintf(path, sizeof(path), "%s[0]", filename) >= (int)sizeof(path))
+			MU_RET_ERRNO(err, ENAMETOOLONG);
+		filename = path;
+	}
+
+	while (shift < MU_PYRAMID_DRAFT && (width >> (shift + 1)) >= t_width && (height >> (shift + 1)) >= t_height)
+		shift++;
+
+	// The coder picks its scale as floor(size / hint), so the hint is rounded down
+	if (shift > 0 && nframes <= 1 && is_jpeg_filename(filename)) {
+		snprintf(geometry, sizeof(geometry), "%zux%zu", width >> shift, height >> shift);
+		MagickSetOption(master, "jpeg:size", geometry);
+	}
+
+	if (MagickReadImage(master, filename) == MagickFalse) {
+		RaiseWandException(master, err);
+		return -1;
+	}
+	// The first frame is never reduced, whatever its size
+	if ((MagickGetImageWidth(master) == width && MagickGetImageHeight(master) == height) || nframes > 1) {
+		init_pyramid(pyr, master);
+		return 0;
+	}
+
+	// Anything but the expected reduction is read again in full
+	if (MagickGetImageWidth(master) != (width + (1 << shift) - 1) >> shift ||
+			MagickGetImageHeight(master) != (height + (1 << shift) - 1) >> shift) {
+		ClearMagickWand(master);
+		if (MagickReadImage(master, filename) == MagickFalse) {
+			RaiseWandException(master, err);
+			return -1;
+		}
+		init_pyramid(pyr, master);
+		return 0;
+	}
+
+	// Clones share the pixels, clearing master also drops the size hint
+	draft = CloneMagickWand(master);
+	if (draft == NULL) {
+		RaiseWandException(master, err);
+		return -1;
+	}
+	ClearMagickWand(master);
+
+	destroy_pyramid(pyr);
+	pyr->level[0] = master;
+	pyr->width[0] = width;
+	pyr->height[0] = height;
+	pyr->level[shift] = draft;
+	pyr->width[shift] = MagickGetImageWidth(draft);
+	pyr->height[shift] = MagickGetImageHeight(draft);
+	pyr->nlevels = shift + 1;
+	pyr->pending = filename;
+
+	return 0;
+}
+
+// Passes progress on to the job's monitor and records whether it aborted the decode
+struct mu_decode_monitor {
+	MagickProgressMonitor monitor;
+	void *data;
+	bool aborted;
+};
+
+static MagickBooleanType decode_monitor(const char *text, const MagickOffsetType offset, const MagickSizeType span, void *data)
+{
+	struct mu_decode_monitor *dm = data;
+
+	if (dm->monitor(text, offset, span, dm->data) == MagickFalse)
+		dm->aborted = true;
+	return dm->aborted ? MagickFalse : MagickTrue;
+}
+
+/*
+ * Decodes the full master of a pyramid started from a draft. The decode can
+ * be aborted through monitor, without an error; the master then stays
+ * pending for the next job that needs it.
+ */
+int load_master(struct mu_error **err, struct mu_pyramid *pyr, MagickProgressMonitor monitor, void *data)
+{
+	struct mu_decode_monitor dm = { monitor, data, false };
+	MagickBooleanType status;
+
+	if (pyr->pending == NULL)
+		return 0;
+
+	if (monitor)
+		MagickSetProgressMonitor(pyr->level[0], decode_monitor, &dm);
+	status = MagickReadImage(pyr->level[0], pyr->pending);
+	MagickSetProgressMonitor(pyr->level[0], NULL, NULL);
+	// Coders stop early but may still return what they decoded
+	if (dm.aborted) {
+		ClearMagickWand(pyr->level[0]);
+		return -1;
+	}
+	if (status == MagickFalse) {
+		RaiseWandException(pyr->level[0], err);
+		return -1;
+	}
+	// Decoded images keep the monitor, which must not outlive dm
+	if (monitor)
+		MagickSetImageProgressMonitor(pyr->level[0], NULL, NULL);
+	pyr->pending = NULL;
+
+	return build_pyramid(err, pyr);
+}
+
+/*
+ * Builds successive half-size levels with a box filter until the longer side
+ * would drop below MU_PYRAMID_MIN. Levels that exist already are kept, and
+ * those above a draft wait until the master is loaded.
+ */
+int build_pyramid(struct mu_error **err, struct mu_pyramid *pyr)
+{
+	size_t width, height;
+
+	if (pyr->tiled)
+		return 0;
+
+	for (size_t i = 1; i < MU_PYRAMID_MAX; i++) {
+		MagickWand *wand, *src = pyr->level[i - 1];
+
+		if (pyr->level[i] || src == NULL || (i == 1 && pyr->pending))
+			continue;
+
+		width  = pyr->width[i - 1] / 2;
+		height = pyr->height[i - 1] / 2;
+		if ((width > height ? width : height) < MU_PYRAMID_MIN || width == 0 || height == 0)
+			break;
+
+		wand = CloneMagickWand(src);
+		if (wand == NULL) {
+			RaiseWandException(src, err);
+			return -1;
+		}
+		if (MagickResizeImage(wand, width, height, BoxFilter) == MagickFalse) {
+			RaiseWandException(wand, err);
+			wand = DestroyMagickWand(wand);
+			return -1;
+		}
+
+		pyr->level[i] = wand;
+		pyr->width[i] = width;
+		pyr->height[i] = height;
+		if (pyr->nlevels <= i)
+			pyr->nlevels = i + 1;
+	}
+
+	return 0;
+}
+
+void destroy_pyramid(struct mu_pyramid *pyr)
+{
+	for (size_t i = 1; i < pyr->nlevels; i++) {
+		if (pyr->level[i])
+			pyr->level[i] = DestroyMagickWand(pyr->level[i]);
+	}
+
+	memset(pyr, 0, sizeof(struct mu_pyramid));
+}
+
+/*
+ * Returns the smallest level on which a s_width x s_height region of the
+ * master still covers t_width x t_height pixels. Levels not built yet are
+ * skipped, so this may be a pending master.
+ */
+size_t pyramid_select(struct mu_pyramid *pyr, size_t s_width, size_t s_height, size_t t_width, size_t t_height)
+{
+	size_t i;
+
+	for (i = pyr->nlevels; i > 1; i--) {
+		double scale_x = (double)pyr->width[i - 1] / (double)pyr->width[0];
+		double scale_y = (double)pyr->height[i - 1] / (double)pyr->height[0];
+
+		if (pyr->level[i - 1] == NULL)
+			continue;
+		if (s_width * scale_x >= t_width && s_height * scale_y >= t_height)
+			break;
+	}
+
+	return i - 1;
+}
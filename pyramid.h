@@ -0,0 +1,42 @@
+#ifndef MU_PYRAMID_H
+#define MU_PYRAMID_H
+
+#include <MagickWand/MagickWand.h>
+
+#include "util/error.h"
+
+#define MU_PYRAMID_MAX 16
+#define MU_PYRAMID_MIN 256
+
+// Largest reduction asked of decoders that can scale while decoding (JPEG: 1/8)
+#define MU_PYRAMID_DRAFT 3
+
+/*
+ * Power-of-two downsampled copies of the master image.
+ * level[0] is the master itself and is not owned by the pyramid.
+ * For tiled sources there is no master; previews are read from the file and
+ * only width[0]/height[0] are set.
+ * A pyramid started from a reduced decode has that draft as its first level
+ * and leaves the master unread (pending names its file) until a job needs it;
+ * the levels in between stay NULL until then.
+ */
+struct mu_pyramid {
+	MagickWand *level[MU_PYRAMID_MAX];
+	size_t width[MU_PYRAMID_MAX];
+	size_t height[MU_PYRAMID_MAX];
+	size_t nlevels;
+
+	const char *tiled;
+	const char *pending;
+};
+
+extern void init_pyramid(struct mu_pyramid *pyr, MagickWand *master);
+extern void init_pyramid_tiled(struct mu_pyramid *pyr, const char *filename, size_t width, size_t height);
+extern int read_pyramid(struct mu_error **err, struct mu_pyramid *pyr, MagickWand *master, const char *filename,
+		size_t nframes, size_t width, size_t height, size_t t_width, size_t t_height);
+extern int load_master(struct mu_error **err, struct mu_pyramid *pyr, MagickProgressMonitor monitor, void *data);
+extern int build_pyramid(struct mu_error **err, struct mu_pyramid *pyr);
+extern void destroy_pyramid(struct mu_pyramid *pyr);
+extern size_t pyramid_select(struct mu_pyramid *pyr, size_t s_width, size_t s_height, size_t t_width, size_t t_height);
+
+#endif
@@ -0,0 +1,293 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "frames.h"
+#include "jpegcrop.h"
+#include "save.h"
+#include "tiled.h"
+#include "trace.h"
+#include "util/error.h"
+#include "util/mem.h"
+#include "util/time.h"
+#include "util/wand.h"
+
+/*
+ * Creates a hidden file next to dst_filename whose name ends in the same
+ * extension, so that ImageMagick and is_jpeg_filename() pick the same format.
+ * It gets dst_filename's permissions if that exists.
+ */
+int open_temp(struct mu_error **err, const char *dst_filename, char **tmp_filename)
+{
+	static unsigned int seq;
+	const char *base = strrchr(dst_filename, '/');
+	int dirlen = base ? (int)(base - dst_filename + 1) : 0;
+	size_t size = strlen(dst_filename) + 64;
+	struct stat st;
+	char *tmp;
+	int fd;
+
+	base = base ? base + 1 : dst_filename;
+	tmp = malloc(size);
+	if (tmp == NULL)
+		MU_RET_ERRNO(err, ENOMEM);
+
+	do {
+		snprintf(tmp, size, "%.*s.mucrop-%ld-%u-%s", dirlen, dst_filename, (long)getpid(),
+				__atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED), base);
+		fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	} while (fd < 0 && errno == EEXIST);
+	if (fd < 0) {
+		MU_PUSH_ERRF(err, "%s: %s", tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+
+	if (stat(dst_filename, &st) == 0)
+		fchmod(fd, st.st_mode & 07777);
+
+	*tmp_filename = tmp;
+	return fd;
+}
+
+// Makes the written temporary file durable and moves it over dst_filename
+int commit_temp(struct mu_error **err, int fd, const char *tmp_filename, const char *dst_filename)
+{
+	char *dir;
+	int dfd;
+
+	if (fsync(fd) != 0) {
+		MU_PUSH_ERRF(err, "%s: %s", tmp_filename, strerror(errno));
+		return -1;
+	}
+	if (rename(tmp_filename, dst_filename) != 0) {
+		MU_PUSH_ERRF(err, "%s: %s", dst_filename, strerror(errno));
+		return -1;
+	}
+
+	// The rename itself is only durable once the directory is synced; best effort
+	dir = strdup(dst_filename);
+	if (dir == NULL)
+		return 0;
+	if (strrchr(dir, '/'))
+		*strrchr(dir, '/') = '\0';
+	else
+		strcpy(dir, ".");
+	dfd = open(*dir ? dir : "/", O_RDONLY | O_CLOEXEC);
+	if (dfd >= 0) {
+		fsync(dfd);
+		close(dfd);
+	}
+	free(dir);
+
+	return 0;
+}
+
+// Writes every frame of a multi-frame source, cropped on save->nthreads threads
+static int write_frames(struct mu_error **err, struct mu_save *save, const char *dst_filename)
+{
+	struct mu_span span;
+	MagickBooleanType status;
+
+	span_begin(&span, "read_frames");
+	if (save->crop) {
+		status = MagickPingImage(save->master, save->src_filename);
+		if (status != MagickFalse && crop_frames(err, save->master, save->src_filename,
+					save->x, save->y, save->width, save->height, save->nthreads) != 0) {
+			span_end(&span);
+			return -1;
+		}
+	} else {
+		status = MagickReadImage(save->master, save->src_filename);
+	}
+	span_end(&span);
+	if (status == MagickFalse) {
+		RaiseWandException(save->master, err);
+		return -1;
+	}
+
+	span_begin(&span, "write");
+	status = MagickWriteImages(save->master, dst_filename, MagickTrue);
+	span_end(&span);
+	if (status == MagickFalse) {
+		RaiseWandException(save->master, err);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the crop to dst_filename, losslessly for JPEG to JPEG when possible.
+ * Shared with the batch mode, which passes a save it never starts.
+ */
+int write_crop(struct mu_error **err, struct mu_save *save, const char *dst_filename)
+{
+	char geometry[64];
+	struct mu_span span;
+	MagickBooleanType status;
+	int ret;
+
+	if (save->nframes > 1)
+		return write_frames(err, save, dst_filename);
+
+	if (save->crop && is_jpeg_filename(dst_filename)) {
+		ret = jpeg_crop(err, save->src_filename, dst_filename,
+				save->x, save->y, save->width, save->height, save->jpeg_snap);
+		if (ret <= 0)
+			return ret;
+	}
+
+	if (save->read && save->tiled && save->crop) {
+		// ImageMagick's TIFF coder would decode the whole raster before extracting
+		span_begin(&span, "read_tiff_crop");
+		ret = read_tiff_crop(err, save->src_filename, save->x, save->y,
+				save->width, save->height, save->master);
+		span_end(&span);
+		if (ret != 0)
+			return -1;
+	} else if (save->read) {
+		// The decoder may still read the whole image before extracting the crop
+		if (save->crop) {
+			snprintf(geometry, sizeof(geometry), "%zux%zu+%zu+%zu",
+					save->width, save->height, save->x, save->y);
+			MagickSetExtract(save->master, geometry);
+		}
+		if (MagickReadImage(save->master, save->src_filename) == MagickFalse) {
+			RaiseWandException(save->master, err);
+			return -1;
+		}
+	} else if (save->crop) {
+		span_begin(&span, "crop");
+		status = MagickCropImage(save->master, save->width, save->height, save->x, save->y);
+		span_end(&span);
+		if (status == MagickFalse) {
+			RaiseWandException(save->master, err);
+			return -1;
+		}
+	}
+
+	span_begin(&span, "write");
+	status = MagickWriteImage(save->master, dst_filename);
+	span_end(&span);
+	if (status == MagickFalse) {
+		RaiseWandException(save->master, err);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *save_main(void *data)
+{
+	struct mu_save *save = data;
+	struct mu_span span;
+	char *tmp_filename;
+	int fd;
+
+	trace_thread_name("save");
+	span_begin(&span, "save");
+
+	save->ret = -1;
+	fd = open_temp(&save->errlist, save->dst_filename, &tmp_filename);
+	if (fd >= 0) {
+		save->ret = write_crop(&save->errlist, save, tmp_filename);
+		if (save->ret == 0)
+			save->ret = commit_temp(&save->errlist, fd, tmp_filename, save->dst_filename);
+		close(fd);
+		if (save->ret != 0)
+			unlink(tmp_filename);
+		free(tmp_filename);
+	}
+	save->master = DestroyMagickWand(save->master);
+
+	span_end(&span);
+	trace_counters();
+
+	return NULL;
+}
+
+/*
+ * Starts writing the crop described by req and adds it to saves. The save
+ * takes over req->master, also when it fails to start.
+ */
+int start_save(struct mu_error **err, struct mu_save **saves, const struct mu_save *req)
+{
+	struct mu_save *save;
+	int ret;
+
+	save = mallocz(sizeof(struct mu_save));
+	if (save == NULL) {
+		DestroyMagickWand(req->master);
+		MU_RET_ERRNO(err, ENOMEM);
+	}
+	*save = *req;
+	save->next = NULL;
+
+	save->errlist = create_errlist(1);
+	if (save->errlist == NULL) {
+		DestroyMagickWand(save->master);
+		free(save);
+		MU_RET_ERRNO(err, ENOMEM);
+	}
+
+	ret = pthread_create(&save->thread, NULL, save_main, save);
+	if (ret != 0) {
+		DestroyMagickWand(save->master);
+		free_errlist(&save->errlist);
+		free(save);
+		MU_RET_ERRNO(err, ret);
+	}
+
+	save->next = *saves;
+	*saves = save;
+
+	return 0;
+}
+
+// Whether a save to filename has not been waited for yet
+bool is_saving(struct mu_save *saves, const char *filename)
+{
+	for (; saves; saves = saves->next) {
+		if (strcmp(saves->dst_filename, filename) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Waits for the saves to filename, or all of them if it is NULL, and reports
+ * their errors. Returns non-zero if any of them failed.
+ */
+int wait_saves(struct mu_save **saves, const char *filename)
+{
+	struct mu_save **link = saves;
+	int ret = 0;
+
+	while (*link) {
+		struct mu_save *save = *link;
+
+		if (filename && strcmp(save->dst_filename, filename) != 0) {
+			link = &save->next;
+			continue;
+		}
+
+		pthread_join(save->thread, NULL);
+		ret |= process_errors(save->errlist) | save->ret;
+		free_errlist(&save->errlist);
+
+		*link = save->next;
+		free(save);
+	}
+
+	return ret;
+}
@@ -0,0 +1,51 @@
+#ifndef MU_SAVE_H
+#define MU_SAVE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "util/error.h"
+
+/*
+ * A crop being written on a thread of its own, so the window does not wait
+ * for the encode. master is owned by the save: either the decoded image, or
+ * an empty wand when only the crop is to be read from src_filename (tiled
+ * sources, masters never decoded, sources of more than one frame). The result
+ * goes to a temporary file next to dst_filename that is synced and renamed
+ * over it. Frames are cropped on nthreads threads, 0 for one per core.
+ */
+struct mu_save {
+	pthread_t thread;
+	struct mu_error *errlist;
+	struct mu_save *next;
+
+	const char *src_filename;
+	const char *dst_filename;
+	MagickWand *master;
+	bool read;
+	bool tiled;
+	size_t nframes;
+	size_t nthreads;
+
+	bool crop;
+	size_t x;
+	size_t y;
+	size_t width;
+	size_t height;
+	bool jpeg_snap;
+
+	int ret;
+};
+
+extern int open_temp(struct mu_error **err, const char *dst_filename, char **tmp_filename);
+extern int commit_temp(struct mu_error **err, int fd, const char *tmp_filename, const char *dst_filename);
+
+extern int write_crop(struct mu_error **err, struct mu_save *save, const char *dst_filename);
+extern int start_save(struct mu_error **err, struct mu_save **saves, const struct mu_save *req);
+extern bool is_saving(struct mu_save *saves, const char *filename);
+extern int wait_saves(struct mu_save **saves, const char *filename);
+
+#endif
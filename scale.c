@@ -0,0 +1,287 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MU_SCALE_X86
+#include <immintrin.h>
+#endif
+
+#include "scale.h"
+#include "util/mem.h"
+
+/*
+ * Separable area-averaging downscaler for 8-bit BGRA. Weights are the exact
+ * overlap of each source pixel with the output pixel, in fixed point summing
+ * to 1 << MU_WBITS. The vertical pass reduces a band of source rows into one
+ * row of 16-bit values with 8 fractional bits, the horizontal pass reduces
+ * that row into output pixels.
+ */
+#define MU_WBITS 15
+// Output rows between two polls of the abort callback
+#define MU_SCALE_POLL 16
+
+struct mu_filter {
+	size_t *start;
+	size_t *count;
+	uint16_t *weights;
+	size_t stride;
+};
+
+static void free_filter(struct mu_filter *f)
+{
+	free(f->start);
+	free(f->count);
+	free(f->weights);
+}
+
+static int init_filter(struct mu_filter *f, size_t s_len, size_t len)
+{
+	double scale = (double)s_len / (double)len;
+
+	f->stride = (size_t)scale + 2;
+	f->start = malloc(len * sizeof(size_t));
+	f->count = malloc(len * sizeof(size_t));
+	f->weights = mallocz(len * f->stride * sizeof(uint16_t));
+	if (f->start == NULL || f->count == NULL || f->weights == NULL)
+		return -1;
+
+	for (size_t i = 0; i < len; i++) {
+		double lo = i * scale, hi = (i + 1) * scale;
+		size_t j0 = (size_t)lo, j1 = (size_t)hi;
+		uint16_t *w = f->weights + i * f->stride;
+		uint32_t sum = 0;
+		size_t n = 0;
+
+		if (j1 >= s_len)
+			j1 = s_len - 1;
+		if ((double)j1 == hi && j1 > j0)
+			j1--;
+
+		for (size_t j = j0; j <= j1 && n < f->stride; j++, n++) {
+			double a = j > lo ? j : lo, b = j + 1 < hi ? j + 1 : hi;
+
+			w[n] = (b - a) / scale * (1 << MU_WBITS) + 0.5;
+			sum += w[n];
+		}
+		// Rounding error goes to the largest weight so rows sum up exactly
+		if (n > 0) {
+			size_t big = 0;
+			for (size_t k = 1; k < n; k++)
+				if (w[k] > w[big])
+					big = k;
+			w[big] += (1 << MU_WBITS) - (int32_t)sum;
+		}
+
+		f->start[i] = j0;
+		f->count[i] = n;
+	}
+
+	return 0;
+}
+
+static void vert_scalar(const unsigned char **rows, const uint16_t *w, size_t n, uint16_t *out, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		uint32_t acc = 0;
+
+		for (size_t k = 0; k < n; k++)
+			acc += rows[k][i] * (uint32_t)w[k];
+		out[i] = (acc + (1 << (MU_WBITS - 9))) >> (MU_WBITS - 8);
+	}
+}
+
+static void horiz_scalar(const uint16_t *row, struct mu_filter *f, unsigned char *out, size_t width)
+{
+	for (size_t x = 0; x < width; x++) {
+		const uint16_t *src = row + f->start[x] * 4;
+		const uint16_t *w = f->weights + x * f->stride;
+		uint32_t acc[4] = { 0, 0, 0, 0 };
+
+		for (size_t k = 0; k < f->count[x]; k++) {
+			for (int c = 0; c < 4; c++)
+				acc[c] += src[k * 4 + c] * (uint32_t)w[k];
+		}
+		for (int c = 0; c < 4; c++)
+			out[x * 4 + c] = (acc[c] + (1u << (MU_WBITS + 7))) >> (MU_WBITS + 8);
+	}
+}
+
+#ifdef MU_SCALE_X86
+__attribute__((target("sse2")))
+static void vert_sse2(const unsigned char **rows, const uint16_t *w, size_t n, uint16_t *out, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(1 << (MU_WBITS - 9));
+	const __m128i bias32 = _mm_set1_epi32(0x8000);
+	const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+
+		for (size_t k = 0; k < n; k++) {
+			__m128i wk = _mm_set1_epi16(w[k]);
+			__m128i px = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+			__m128i lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero);
+			__m128i lo_l = _mm_mullo_epi16(lo, wk), lo_h = _mm_mulhi_epu16(lo, wk);
+			__m128i hi_l = _mm_mullo_epi16(hi, wk), hi_h = _mm_mulhi_epu16(hi, wk);
+
+			acc0 = _mm_add_epi32(acc0, _mm_unpacklo_epi16(lo_l, lo_h));
+			acc1 = _mm_add_epi32(acc1, _mm_unpackhi_epi16(lo_l, lo_h));
+			acc2 = _mm_add_epi32(acc2, _mm_unpacklo_epi16(hi_l, hi_h));
+			acc3 = _mm_add_epi32(acc3, _mm_unpackhi_epi16(hi_l, hi_h));
+		}
+
+		// SSE2 has no unsigned 32->16 pack, so bias into signed range and back
+		acc0 = _mm_sub_epi32(_mm_srli_epi32(acc0, MU_WBITS - 8), bias32);
+		acc1 = _mm_sub_epi32(_mm_srli_epi32(acc1, MU_WBITS - 8), bias32);
+		acc2 = _mm_sub_epi32(_mm_srli_epi32(acc2, MU_WBITS - 8), bias32);
+		acc3 = _mm_sub_epi32(_mm_srli_epi32(acc3, MU_WBITS - 8), bias32);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(_mm_packs_epi32(acc0, acc1), bias16));
+		_mm_storeu_si128((__m128i *)(out + i + 8), _mm_xor_si128(_mm_packs_epi32(acc2, acc3), bias16));
+	}
+
+	if (i < len) {
+		const unsigned char *tail[n];
+
+		for (size_t k = 0; k < n; k++)
+			tail[k] = rows[k] + i;
+		vert_scalar(tail, w, n, out + i, len - i);
+	}
+}
+
+__attribute__((target("sse2")))
+static void horiz_sse2(const uint16_t *row, struct mu_filter *f, unsigned char *out, size_t width)
+{
+	const __m128i round = _mm_set1_epi32(1u << (MU_WBITS + 7));
+
+	for (size_t x = 0; x < width; x++) {
+		const uint16_t *src = row + f->start[x] * 4;
+		const uint16_t *w = f->weights + x * f->stride;
+		__m128i acc = round;
+
+		for (size_t k = 0; k < f->count[x]; k++) {
+			__m128i wk = _mm_set1_epi16(w[k]);
+			__m128i px = _mm_loadl_epi64((const __m128i *)(src + k * 4));
+
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(_mm_mullo_epi16(px, wk), _mm_mulhi_epu16(px, wk)));
+		}
+
+		acc = _mm_srli_epi32(acc, MU_WBITS + 8);
+		acc = _mm_packs_epi32(acc, acc);
+		acc = _mm_packus_epi16(acc, acc);
+		*(int32_t *)(out + x * 4) = _mm_cvtsi128_si32(acc);
+	}
+}
+
+__attribute__((target("avx2")))
+static void vert_avx2(const unsigned char **rows, const uint16_t *w, size_t n, uint16_t *out, size_t len)
+{
+	const __m256i round = _mm256_set1_epi32(1 << (MU_WBITS - 9));
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m256i acc0 = round, acc1 = round;
+
+		for (size_t k = 0; k < n; k++) {
+			__m256i wk = _mm256_set1_epi16(w[k]);
+			__m256i px = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[k] + i)));
+			__m256i lo = _mm256_mullo_epi16(px, wk), hi = _mm256_mulhi_epu16(px, wk);
+
+			// Unpack and pack below both work per 128-bit lane, so the order comes back out right
+			acc0 = _mm256_add_epi32(acc0, _mm256_unpacklo_epi16(lo, hi));
+			acc1 = _mm256_add_epi32(acc1, _mm256_unpackhi_epi16(lo, hi));
+		}
+
+		acc0 = _mm256_srli_epi32(acc0, MU_WBITS - 8);
+		acc1 = _mm256_srli_epi32(acc1, MU_WBITS - 8);
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_packus_epi32(acc0, acc1));
+	}
+
+	if (i < len) {
+		const unsigned char *tail[n];
+
+		for (size_t k = 0; k < n; k++)
+			tail[k] = rows[k] + i;
+		vert_scalar(tail, w, n, out + i, len - i);
+	}
+}
+#endif
+
+typedef void (*vert_fn)(const unsigned char **rows, const uint16_t *w, size_t n, uint16_t *out, size_t len);
+typedef void (*horiz_fn)(const uint16_t *row, struct mu_filter *f, unsigned char *out, size_t width);
+
+static void select_kernels(vert_fn *vert, horiz_fn *horiz)
+{
+	*vert = vert_scalar;
+	*horiz = horiz_scalar;
+
+#ifdef MU_SCALE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		*vert = vert_sse2;
+		*horiz = horiz_sse2;
+	}
+	if (__builtin_cpu_supports("avx2"))
+		*vert = vert_avx2;
+#endif
+}
+
+/*
+ * Area-averages a BGRA image down to width x height. The target must not be
+ * larger than the source in either dimension. Returns 1 if aborted is given
+ * and asks to stop, leaving dst partly written.
+ */
+int downscale_bgra(const unsigned char *src, size_t s_width, size_t s_height, size_t s_stride,
+		unsigned char *dst, size_t width, size_t height, size_t stride,
+		mu_scale_abort aborted, void *data)
+{
+	struct mu_filter fx = { 0 }, fy = { 0 };
+	const unsigned char **rows = NULL;
+	uint16_t *band = NULL;
+	vert_fn vert;
+	horiz_fn horiz;
+	int ret = -1;
+
+	if (init_filter(&fx, s_width, width) != 0 || init_filter(&fy, s_height, height) != 0)
+		goto out;
+	rows = malloc(fy.stride * sizeof(unsigned char *));
+	band = malloc(s_width * 4 * sizeof(uint16_t));
+	if (rows == NULL || band == NULL)
+		goto out;
+
+	select_kernels(&vert, &horiz);
+
+	for (size_t y = 0; y < height; y++) {
+		if (aborted && y % MU_SCALE_POLL == 0 && aborted(data)) {
+			ret = 1;
+			goto out;
+		}
+		for (size_t k = 0; k < fy.count[y]; k++)
+			rows[k] = src + (fy.start[y] + k) * s_stride;
+		vert(rows, fy.weights + y * fy.stride, fy.count[y], band, s_width * 4);
+		horiz(band, &fx, dst + y * stride, width);
+	}
+	ret = 0;
+
+out:
+	free_filter(&fx);
+	free_filter(&fy);
+	free(rows);
+	free(band);
+	return ret;
+}
+
+// Nearest-neighbour resample, for previews that only need to be quick
+void sample_bgra(const unsigned char *src, size_t s_width, size_t s_height, size_t s_stride,
+		unsigned char *dst, size_t width, size_t height, size_t stride)
+{
+	for (size_t y = 0; y < height; y++) {
+		const uint32_t *s = (const uint32_t *)(src + (y * s_height / height) * s_stride);
+		uint32_t *d = (uint32_t *)(dst + y * stride);
+
+		for (size_t x = 0; x < width; x++)
+			d[x] = s[x * s_width / width];
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef MU_SCALE_H
+#define MU_SCALE_H
+
+#include <stddef.h>
+
+// Polled between bands of output rows, a non-zero return aborts the resample
+typedef int (*mu_scale_abort)(void *data);
+
+extern int downscale_bgra(const unsigned char *src, size_t s_width, size_t s_height, size_t s_stride,
+		unsigned char *dst, size_t width, size_t height, size_t stride,
+		mu_scale_abort aborted, void *data);
+extern void sample_bgra(const unsigned char *src, size_t s_width, size_t s_height, size_t s_stride,
+		unsigned char *dst, size_t width, size_t height, size_t stride);
+
+#endif
@@ -0,0 +1,691 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tiffio.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "tiled.h"
+#include "util/error.h"
+#include "util/mem.h"
+#include "util/wand.h"
+
+/*
+ * Box filter accumulating source rows of the region into width x height BGRA
+ * output rows. Only the output rows the source rows fed between two flushes
+ * can reach are held, so its memory scales with the target, not the source.
+ */
+struct mu_box {
+	unsigned char *out;
+	size_t width;
+	size_t height;
+	size_t s_width;
+	size_t s_height;
+
+	size_t *col_of;
+	uint32_t *ncols;
+	uint64_t *sum;
+	size_t nslots;
+	size_t next;
+};
+
+// rows is the most source rows fed between two calls to flush_box()
+static int init_box(struct mu_box *box, unsigned char *out, size_t s_width, size_t s_height,
+		size_t width, size_t height, size_t rows)
+{
+	memset(box, 0, sizeof(struct mu_box));
+	box->out = out;
+	box->width = width;
+	box->height = height;
+	box->s_width = s_width;
+	box->s_height = s_height;
+	box->nslots = rows * height / s_height + 2;
+	if (box->nslots > height)
+		box->nslots = height;
+
+	box->col_of = malloc(s_width * sizeof(size_t));
+	box->ncols = mallocz(width * sizeof(uint32_t));
+	box->sum = mallocz(box->nslots * width * 4 * sizeof(uint64_t));
+	if (box->col_of == NULL || box->ncols == NULL || box->sum == NULL)
+		return -1;
+
+	for (size_t sx = 0; sx < s_width; sx++) {
+		box->col_of[sx] = sx * width / s_width;
+		box->ncols[box->col_of[sx]]++;
+	}
+	memset(out, 0, width * height * 4);
+
+	return 0;
+}
+
+static void free_box(struct mu_box *box)
+{
+	free(box->col_of);
+	free(box->ncols);
+	free(box->sum);
+}
+
+// First source row of output row oy
+static size_t first_row(struct mu_box *box, size_t oy)
+{
+	return (oy * box->s_height + box->height - 1) / box->height;
+}
+
+// Adds n packed ABGR pixels of source row sy, starting at column sx
+static void feed_span(struct mu_box *box, size_t sy, size_t sx, const uint32_t *abgr, size_t n)
+{
+	size_t oy = sy * box->height / box->s_height;
+	uint64_t *row = box->sum + (oy % box->nslots) * box->width * 4;
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t *sum = row + box->col_of[sx + i] * 4;
+		uint32_t p = abgr[i];
+
+		sum[0] += TIFFGetB(p);
+		sum[1] += TIFFGetG(p);
+		sum[2] += TIFFGetR(p);
+		sum[3] += TIFFGetA(p);
+	}
+}
+
+// Emits the output rows whose source rows all come before sy_end
+static void flush_box(struct mu_box *box, size_t sy_end)
+{
+	while (box->next < box->height && first_row(box, box->next + 1) <= sy_end) {
+		uint64_t *sum = box->sum + (box->next % box->nslots) * box->width * 4;
+		unsigned char *dst = box->out + box->next * box->width * 4;
+		uint64_t nrows = first_row(box, box->next + 1) - first_row(box, box->next);
+
+		for (size_t ox = 0; ox < box->width; ox++) {
+			uint64_t n = (uint64_t)box->ncols[ox] * nrows;
+
+			for (int c = 0; c < 4; c++)
+				dst[ox * 4 + c] = n ? sum[ox * 4 + c] / n : 0;
+		}
+		memset(sum, 0, box->width * 4 * sizeof(uint64_t));
+		box->next++;
+	}
+}
+
+bool is_tiff_file(const char *filename)
+{
+	unsigned char magic[4];
+	FILE *fp = fopen(filename, "rb");
+	bool ret = false;
+
+	if (fp == NULL)
+		return false;
+	if (fread(magic, 1, 4, fp) == 4) {
+		ret = (magic[0] == 'I' && magic[1] == 'I' && (magic[2] == 42 || magic[2] == 43) && magic[3] == 0) ||
+			(magic[0] == 'M' && magic[1] == 'M' && magic[2] == 0 && (magic[3] == 42 || magic[3] == 43));
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+static bool aborted(MagickProgressMonitor monitor, void *data, size_t row, size_t rows)
+{
+	return monitor != NULL && monitor(NULL, row, rows, data) == MagickFalse;
+}
+
+// Scanlines are only converted by hand for these layouts, libtiff's RGBA reader does the rest
+struct mu_layout {
+	uint16_t photometric;
+	uint16_t bps;
+	uint16_t spp;
+	bool alpha;
+	uint16_t *red;
+	uint16_t *green;
+	uint16_t *blue;
+};
+
+static bool get_layout(TIFF *tif, struct mu_layout *l)
+{
+	uint16_t planar, compression, nextra, *extra;
+
+	memset(l, 0, sizeof(struct mu_layout));
+	TIFFGetFieldDefaulted(tif, TIFFTAG_PHOTOMETRIC, &l->photometric);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &l->bps);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &l->spp);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+	if (TIFFGetField(tif, TIFFTAG_EXTRASAMPLES, &nextra, &extra) != 1)
+		nextra = 0;
+
+	// libjpeg converts YCbCr itself when asked
+	if (compression == COMPRESSION_JPEG && l->photometric == PHOTOMETRIC_YCBCR) {
+		TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+		l->photometric = PHOTOMETRIC_RGB;
+	}
+	if (planar != PLANARCONFIG_CONTIG && l->spp > 1)
+		return false;
+
+	switch (l->photometric) {
+		case PHOTOMETRIC_MINISWHITE:
+		case PHOTOMETRIC_MINISBLACK:
+			l->alpha = l->spp >= 2 && nextra > 0;
+			return l->bps == 1 || l->bps == 2 || l->bps == 4 || l->bps == 8 || l->bps == 16;
+		case PHOTOMETRIC_PALETTE:
+			return l->spp == 1 && l->bps <= 8 &&
+				TIFFGetField(tif, TIFFTAG_COLORMAP, &l->red, &l->green, &l->blue) == 1;
+		case PHOTOMETRIC_RGB:
+			l->alpha = l->spp >= 4 && nextra > 0;
+			return l->spp >= 3 && (l->bps == 8 || l->bps == 16);
+		default:
+			return false;
+	}
+}
+
+// Sample i of a scanline, unscaled
+static unsigned int get_sample(const unsigned char *line, size_t i, uint16_t bps)
+{
+	size_t bit = i * bps;
+
+	switch (bps) {
+		case 8:
+			return line[i];
+		case 16:
+			return ((const uint16_t *)line)[i];
+		default:
+			return (line[bit / 8] >> (8 - bps - bit % 8)) & ((1 << bps) - 1);
+	}
+}
+
+// Sample i of a scanline scaled to 8 bits
+static unsigned int get_sample8(const unsigned char *line, size_t i, uint16_t bps)
+{
+	unsigned int v = get_sample(line, i, bps);
+
+	if (bps == 16)
+		return v >> 8;
+	return bps == 8 ? v : v * 255 / ((1 << bps) - 1);
+}
+
+#define PACK_ABGR(r, g, b, a) ((uint32_t)(r) | (uint32_t)(g) << 8 | (uint32_t)(b) << 16 | (uint32_t)(a) << 24)
+
+// Converts w pixels of a scanline from column x into packed ABGR, the way TIFFReadRGBA* returns them
+static void convert_line(const struct mu_layout *l, const unsigned char *line, size_t x, size_t w, uint32_t *abgr)
+{
+	for (size_t i = 0; i < w; i++) {
+		size_t s = (x + i) * l->spp;
+		unsigned int r, g, b, a = 255;
+
+		switch (l->photometric) {
+			case PHOTOMETRIC_PALETTE: {
+				unsigned int idx = get_sample(line, s, l->bps);
+
+				r = l->red[idx] >> 8;
+				g = l->green[idx] >> 8;
+				b = l->blue[idx] >> 8;
+				break;
+			}
+			case PHOTOMETRIC_RGB:
+				r = get_sample8(line, s, l->bps);
+				g = get_sample8(line, s + 1, l->bps);
+				b = get_sample8(line, s + 2, l->bps);
+				if (l->alpha)
+					a = get_sample8(line, s + 3, l->bps);
+				break;
+			default:
+				r = g = b = get_sample8(line, s, l->bps);
+				if (l->photometric == PHOTOMETRIC_MINISWHITE)
+					r = g = b = 255 - r;
+				if (l->alpha)
+					a = get_sample8(line, s + 1, l->bps);
+				break;
+		}
+		abgr[i] = PACK_ABGR(r, g, b, a);
+	}
+}
+
+/*
+ * Where the decoded rows of a region go: spans of packed ABGR pixels, with
+ * flush() called once every row before sy_end (relative to the region) has
+ * been fed. At most rows source rows are fed between two flushes.
+ */
+struct mu_sink {
+	void (*span)(void *ctx, size_t sy, size_t sx, const uint32_t *abgr, size_t n);
+	int (*flush)(void *ctx, size_t sy_end);
+	void *ctx;
+};
+
+/*
+ * libtiff's RGBA readers return tiles bottom-up. Each row of a tile goes to
+ * the sink as it is, so only one tile is held.
+ */
+static int read_tiles(TIFF *tif, const struct mu_sink *sink, size_t x, size_t y, size_t w, size_t h,
+		MagickProgressMonitor monitor, void *data)
+{
+	uint32_t iw, ih, tw, th;
+	uint32_t *tile;
+	int ret = -1;
+
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &iw);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &ih);
+	TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+	TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+
+	tile = malloc((size_t)tw * th * sizeof(uint32_t));
+	if (tile == NULL)
+		return -1;
+
+	for (size_t row = y - y % th; row < y + h; row += th) {
+		size_t n = row + th > ih ? ih - row : th;
+		size_t r0 = row < y ? y : row;
+		size_t r1 = row + n > y + h ? y + h : row + n;
+
+		for (size_t col = x - x % tw; col < x + w; col += tw) {
+			size_t c0 = col < x ? x : col;
+			size_t c1 = col + tw > x + w ? x + w : col + tw;
+
+			if (!TIFFReadRGBATile(tif, col, row, tile))
+				goto out;
+			for (size_t r = r0; r < r1; r++)
+				sink->span(sink->ctx, r - y, c0 - x, tile + (th - 1 - (r - row)) * tw + (c0 - col), c1 - c0);
+		}
+
+		if (sink->flush(sink->ctx, r1 - y) != 0 || aborted(monitor, data, row, ih))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	free(tile);
+	return ret;
+}
+
+// Rows per progress poll when reading scanlines
+#define MU_TILED_POLL 64
+
+/*
+ * Reads strips one scanline at a time, so a file stored as a single strip is
+ * never held whole. libtiff decodes forward through the strip up to row y.
+ */
+static int read_scanlines(TIFF *tif, const struct mu_layout *l, const struct mu_sink *sink,
+		size_t x, size_t y, size_t w, size_t h, MagickProgressMonitor monitor, void *data)
+{
+	uint32_t ih;
+	unsigned char *line;
+	uint32_t *abgr;
+	int ret = -1;
+
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &ih);
+
+	line = malloc(TIFFScanlineSize(tif));
+	abgr = malloc(w * sizeof(uint32_t));
+	if (line == NULL || abgr == NULL)
+		goto out;
+
+	for (size_t row = y; row < y + h; row++) {
+		if (TIFFReadScanline(tif, line, row, 0) < 0)
+			goto out;
+		convert_line(l, line, x, w, abgr);
+		sink->span(sink->ctx, row - y, 0, abgr, w);
+		if (sink->flush(sink->ctx, row + 1 - y) != 0)
+			goto out;
+		if ((row - y) % MU_TILED_POLL == 0 && aborted(monitor, data, row, ih))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	free(line);
+	free(abgr);
+	return ret;
+}
+
+// Strip buffers libtiff's RGBA reader may allocate for layouts read_scanlines() does not handle
+#define MU_TILED_STRIP ((size_t)64 << 20)
+
+static int read_strips(TIFF *tif, const struct mu_sink *sink, size_t x, size_t y, size_t w, size_t h,
+		MagickProgressMonitor monitor, void *data)
+{
+	uint32_t iw, ih, rps;
+	uint32_t *strip;
+
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &iw);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &ih);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rps);
+	if (rps > ih)
+		rps = ih;
+
+	strip = malloc((size_t)iw * rps * sizeof(uint32_t));
+	if (strip == NULL)
+		return -1;
+
+	for (size_t row = y - y % rps; row < y + h; row += rps) {
+		size_t n = row + rps > ih ? ih - row : rps;
+		size_t r0 = row < y ? y : row;
+		size_t r1 = row + n > y + h ? y + h : row + n;
+
+		if (!TIFFReadRGBAStrip(tif, row, strip)) {
+			free(strip);
+			return -1;
+		}
+		for (size_t r = r0; r < r1; r++)
+			sink->span(sink->ctx, r - y, 0, strip + (n - 1 - (r - row)) * iw + x, w);
+		if (sink->flush(sink->ctx, r1 - y) != 0 || aborted(monitor, data, row, ih)) {
+			free(strip);
+			return -1;
+		}
+	}
+
+	free(strip);
+	return 0;
+}
+
+// Most source rows read_region() feeds between two flushes
+static size_t region_rows(TIFF *tif)
+{
+	struct mu_layout l;
+	uint32_t ih, rps, th;
+
+	if (TIFFIsTiled(tif)) {
+		TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+		return th;
+	}
+	if (get_layout(tif, &l))
+		return 1;
+
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &ih);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rps);
+	return rps > ih ? ih : rps;
+}
+
+// Decodes the x/y/w/h region of the current directory into sink
+static int read_region(struct mu_error **err, TIFF *tif, const struct mu_sink *sink,
+		size_t x, size_t y, size_t w, size_t h, MagickProgressMonitor monitor, void *data)
+{
+	struct mu_layout l;
+	uint32_t iw, rps;
+
+	if (TIFFIsTiled(tif))
+		return read_tiles(tif, sink, x, y, w, h, monitor, data);
+	if (get_layout(tif, &l))
+		return read_scanlines(tif, &l, sink, x, y, w, h, monitor, data);
+
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &iw);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rps);
+	if ((size_t)iw * rps * sizeof(uint32_t) > MU_TILED_STRIP)
+		MU_RET_ERRSTR(err, "TIFF layout not supported for strips this large");
+	return read_strips(tif, sink, x, y, w, h, monitor, data);
+}
+
+/*
+ * Moves tif to the smallest reduced-resolution image (a SubIFD of the first
+ * directory, or a later directory marked as reduced) whose part of the region
+ * still covers width x height, and maps the region onto it.
+ */
+static void select_level(TIFF *tif, size_t *x, size_t *y, size_t *s_width, size_t *s_height,
+		size_t width, size_t height)
+{
+	uint32_t iw, ih, lw, lh, best_w;
+	uint16_t nsub = 0;
+	toff_t *sub = NULL, *subifds = NULL;
+	uint32_t subtype;
+	tdir_t dir = 0, best_dir = 0;
+	toff_t best_sub = 0;
+
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &iw);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &ih);
+	best_w = iw;
+
+#define COVERS(lw, lh) ((*x + *s_width) * (lw) / iw - *x * (lw) / iw >= width && \
+		(*y + *s_height) * (lh) / ih - *y * (lh) / ih >= height)
+
+	if (TIFFGetField(tif, TIFFTAG_SUBIFD, &nsub, &sub) == 1 && nsub > 0) {
+		// The offsets belong to the directory being left
+		subifds = malloc(nsub * sizeof(toff_t));
+		if (subifds)
+			memcpy(subifds, sub, nsub * sizeof(toff_t));
+	}
+	for (uint16_t i = 0; subifds && i < nsub; i++) {
+		if (!TIFFSetSubDirectory(tif, subifds[i]))
+			continue;
+		TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &lw);
+		TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &lh);
+		if (lw < best_w && COVERS(lw, lh)) {
+			best_w = lw;
+			best_sub = subifds[i];
+		}
+	}
+	free(subifds);
+
+	TIFFSetDirectory(tif, 0);
+	while (TIFFReadDirectory(tif)) {
+		dir++;
+		if (!TIFFGetField(tif, TIFFTAG_SUBFILETYPE, &subtype) || !(subtype & FILETYPE_REDUCEDIMAGE))
+			continue;
+		TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &lw);
+		TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &lh);
+		if (lw < best_w && COVERS(lw, lh)) {
+			best_w = lw;
+			best_dir = dir;
+			best_sub = 0;
+		}
+	}
+#undef COVERS
+
+	if (best_sub)
+		TIFFSetSubDirectory(tif, best_sub);
+	else
+		TIFFSetDirectory(tif, best_dir);
+	if (best_w == iw)
+		return;
+
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &lw);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &lh);
+	*s_width  = (*x + *s_width) * lw / iw - *x * lw / iw;
+	*s_height = (*y + *s_height) * lh / ih - *y * lh / ih;
+	*x = *x * lw / iw;
+	*y = *y * lh / ih;
+}
+
+static void box_span(void *ctx, size_t sy, size_t sx, const uint32_t *abgr, size_t n)
+{
+	feed_span(ctx, sy, sx, abgr, n);
+}
+
+static int box_flush(void *ctx, size_t sy_end)
+{
+	flush_box(ctx, sy_end);
+	return 0;
+}
+
+/*
+ * Box-downsamples the x/y/s_width/s_height region of a TIFF into a width x
+ * height BGRA buffer, decoding only the tiles (or strips) that intersect it,
+ * from the smallest reduced-resolution image that is still large enough.
+ * The target must not be larger than the region.
+ */
+int read_tiff_region(struct mu_error **err, const char *filename,
+		size_t x, size_t y, size_t s_width, size_t s_height,
+		unsigned char *bgra, size_t width, size_t height,
+		MagickProgressMonitor monitor, void *data)
+{
+	struct mu_box box;
+	struct mu_sink sink = { box_span, box_flush, &box };
+	TIFF *tif;
+	int ret;
+
+	tif = TIFFOpen(filename, "r");
+	if (tif == NULL)
+		MU_RET_ERRSTR(err, "Could not open TIFF for tiled reading");
+
+	select_level(tif, &x, &y, &s_width, &s_height, width, height);
+
+	if (init_box(&box, bgra, s_width, s_height, width, height, region_rows(tif)) != 0) {
+		free_box(&box);
+		TIFFClose(tif);
+		MU_RET_ERRNO(err, ENOMEM);
+	}
+
+	ret = read_region(err, tif, &sink, x, y, s_width, s_height, monitor, data);
+	flush_box(&box, s_height);
+
+	if (ret != 0 && !aborted(monitor, data, 0, 0))
+		MU_PUSH_ERRF(err, "Could not decode %s", filename);
+
+	free_box(&box);
+	TIFFClose(tif);
+
+	return ret;
+}
+
+/*
+ * Rows of the crop being gathered for MagickImportImagePixels(), as RGB or
+ * RGBA bytes. They are imported a band at a time.
+ */
+struct mu_crop_band {
+	MagickWand *wand;
+	unsigned char *band;
+	size_t width;
+	size_t height;
+	size_t channels;
+	size_t nrows;
+	size_t rows;
+	size_t base;
+};
+
+static void crop_span(void *ctx, size_t sy, size_t sx, const uint32_t *abgr, size_t n)
+{
+	struct mu_crop_band *cb = ctx;
+	unsigned char *dst = cb->band + ((sy - cb->base) * cb->width + sx) * cb->channels;
+
+	for (size_t i = 0; i < n; i++, dst += cb->channels) {
+		dst[0] = TIFFGetR(abgr[i]);
+		dst[1] = TIFFGetG(abgr[i]);
+		dst[2] = TIFFGetB(abgr[i]);
+		if (cb->channels == 4)
+			dst[3] = TIFFGetA(abgr[i]);
+	}
+}
+
+// Imports the band once the next rows might not fit in it
+static int crop_flush(void *ctx, size_t sy_end)
+{
+	struct mu_crop_band *cb = ctx;
+
+	if (sy_end - cb->base + cb->rows <= cb->nrows && sy_end < cb->height)
+		return 0;
+	if (sy_end > cb->base && MagickImportImagePixels(cb->wand, 0, cb->base, cb->width, sy_end - cb->base,
+				cb->channels == 4 ? "RGBA" : "RGB", CharPixel, cb->band) == MagickFalse)
+		return -1;
+	cb->base = sy_end;
+
+	return 0;
+}
+
+// Carries resolution, ICC profile and compression over to the crop
+static void copy_tiff_info(TIFF *tif, MagickWand *wand)
+{
+	float xres, yres;
+	uint16_t unit, compression;
+	uint32_t len;
+	void *icc;
+
+	if (TIFFGetField(tif, TIFFTAG_XRESOLUTION, &xres) && TIFFGetField(tif, TIFFTAG_YRESOLUTION, &yres)) {
+		TIFFGetFieldDefaulted(tif, TIFFTAG_RESOLUTIONUNIT, &unit);
+		MagickSetImageUnits(wand, unit == RESUNIT_CENTIMETER ? PixelsPerCentimeterResolution :
+				unit == RESUNIT_INCH ? PixelsPerInchResolution : UndefinedResolution);
+		MagickSetImageResolution(wand, xres, yres);
+	}
+	if (TIFFGetField(tif, TIFFTAG_ICCPROFILE, &len, &icc))
+		MagickSetImageProfile(wand, "icc", icc, len);
+
+	TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+	switch (compression) {
+		case COMPRESSION_LZW:
+			MagickSetImageCompression(wand, LZWCompression);
+			break;
+		case COMPRESSION_ADOBE_DEFLATE:
+		case COMPRESSION_DEFLATE:
+			MagickSetImageCompression(wand, ZipCompression);
+			break;
+		case COMPRESSION_JPEG:
+			MagickSetImageCompression(wand, JPEGCompression);
+			break;
+		case COMPRESSION_PACKBITS:
+			MagickSetImageCompression(wand, RLECompression);
+			break;
+		case COMPRESSION_CCITTFAX4:
+			MagickSetImageCompression(wand, Group4Compression);
+			break;
+		case COMPRESSION_ZSTD:
+			MagickSetImageCompression(wand, ZstdCompression);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Reads the x/y/width/height crop of a TIFF's first image into wand (left
+ * empty by the caller), decoding only the tiles or strips under it. Rows go
+ * straight into the new image's pixel cache, so nothing but the crop itself
+ * is ever held, and ImageMagick may keep that on disk.
+ */
+int read_tiff_crop(struct mu_error **err, const char *filename, size_t x, size_t y,
+		size_t width, size_t height, MagickWand *wand)
+{
+	struct mu_crop_band cb = { .wand = wand, .width = width, .height = height, .channels = 3 };
+	struct mu_sink sink = { crop_span, crop_flush, &cb };
+	uint16_t nextra, *extra;
+	uint32_t iw, ih;
+	PixelWand *bg;
+	TIFF *tif;
+	int ret = -1;
+
+	tif = TIFFOpen(filename, "r");
+	if (tif == NULL)
+		MU_RET_ERRSTR(err, "Could not open TIFF for tiled reading");
+
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &iw);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &ih);
+	if (width == 0 || height == 0 || x + width > iw || y + height > ih) {
+		MU_PUSH_ERRF(err, "%s: crop outside the image", filename);
+		goto out;
+	}
+	if (TIFFGetField(tif, TIFFTAG_EXTRASAMPLES, &nextra, &extra) == 1 && nextra > 0)
+		cb.channels = 4;
+
+	bg = NewPixelWand();
+	if (bg == NULL) {
+		MU_PUSH_ERRNO(err, ENOMEM);
+		goto out;
+	}
+	PixelSetColor(bg, cb.channels == 4 ? "none" : "black");
+	if (MagickNewImage(wand, width, height, bg) == MagickFalse) {
+		DestroyPixelWand(bg);
+		RaiseWandException(wand, err);
+		goto out;
+	}
+	DestroyPixelWand(bg);
+	copy_tiff_info(tif, wand);
+
+	cb.rows = region_rows(tif);
+	cb.nrows = cb.rows < MU_TILED_POLL ? MU_TILED_POLL : cb.rows;
+	if (cb.nrows > height)
+		cb.nrows = height;
+	cb.band = malloc(width * cb.nrows * cb.channels);
+	if (cb.band == NULL) {
+		MU_PUSH_ERRNO(err, ENOMEM);
+		goto out;
+	}
+
+	ret = read_region(err, tif, &sink, x, y, width, height, NULL, NULL);
+	if (ret != 0)
+		MU_PUSH_ERRF(err, "Could not decode %s", filename);
+
+out:
+	free(cb.band);
+	TIFFClose(tif);
+	if (ret != 0)
+		ClearMagickWand(wand);
+
+	return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef MU_TILED_H
+#define MU_TILED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "util/error.h"
+
+// Sources above this many pixels are never decoded in full for previews
+#define MU_TILED_AREA ((size_t)1 << 28)
+
+extern bool is_tiff_file(const char *filename);
+extern int read_tiff_region(struct mu_error **err, const char *filename,
+		size_t x, size_t y, size_t s_width, size_t s_height,
+		unsigned char *bgra, size_t width, size_t height,
+		MagickProgressMonitor monitor, void *data);
+extern int read_tiff_crop(struct mu_error **err, const char *filename, size_t x, size_t y,
+		size_t width, size_t height, MagickWand *wand);
+
+#endif
@@ -0,0 +1,101 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xcb/xcb.h>
+
+#include "tiles.h"
+#include "util/error.h"
+#include "util/mem.h"
+
+static void unlink_tile(struct mu_tile_cache *cache, struct mu_tile *tile)
+{
+	if (tile->prev)
+		tile->prev->next = tile->next;
+	else
+		cache->head = tile->next;
+	if (tile->next)
+		tile->next->prev = tile->prev;
+	else
+		cache->tail = tile->prev;
+	tile->prev = tile->next = NULL;
+}
+
+static void push_tile(struct mu_tile_cache *cache, struct mu_tile *tile)
+{
+	tile->prev = NULL;
+	tile->next = cache->head;
+	if (cache->head)
+		cache->head->prev = tile;
+	else
+		cache->tail = tile;
+	cache->head = tile;
+}
+
+static void free_tile(struct mu_tile_cache *cache, xcb_connection_t *c, struct mu_tile *tile)
+{
+	unlink_tile(cache, tile);
+	cache->bytes -= (size_t)tile->width * tile->height * 4;
+	xcb_free_pixmap(c, tile->pix);
+	free(tile);
+}
+
+bool tile_key_equal(struct mu_tile_key *a, struct mu_tile_key *b)
+{
+	return a->shift == b->shift && a->tx == b->tx && a->ty == b->ty && a->epoch == b->epoch;
+}
+
+// Looks up a tile and marks it as most recently used
+struct mu_tile *find_tile(struct mu_tile_cache *cache, struct mu_tile_key *key)
+{
+	struct mu_tile *tile;
+
+	for (tile = cache->head; tile != NULL; tile = tile->next) {
+		if (tile_key_equal(&tile->key, key))
+			break;
+	}
+	if (tile == NULL || tile == cache->head)
+		return tile;
+
+	unlink_tile(cache, tile);
+	push_tile(cache, tile);
+
+	return tile;
+}
+
+// Takes ownership of pix, evicting least recently used tiles to stay in budget
+int insert_tile(struct mu_error **err, struct mu_tile_cache *cache, xcb_connection_t *c,
+		struct mu_tile_key *key, xcb_pixmap_t pix, uint16_t width, uint16_t height)
+{
+	struct mu_tile *tile = mallocz(sizeof(struct mu_tile));
+
+	if (tile == NULL) {
+		xcb_free_pixmap(c, pix);
+		MU_RET_ERRNO(err, ENOMEM);
+	}
+
+	tile->key = *key;
+	tile->pix = pix;
+	tile->width = width;
+	tile->height = height;
+	push_tile(cache, tile);
+	cache->bytes += (size_t)width * height * 4;
+
+	while (cache->bytes > cache->budget && cache->tail != tile)
+		free_tile(cache, c, cache->tail);
+
+	return 0;
+}
+
+void drop_tile(struct mu_tile_cache *cache, xcb_connection_t *c, struct mu_tile *tile)
+{
+	free_tile(cache, c, tile);
+}
+
+// Drops every tile and starts a new epoch so tiles still being rendered are ignored
+void flush_tiles(struct mu_tile_cache *cache, xcb_connection_t *c)
+{
+	while (cache->head)
+		free_tile(cache, c, cache->head);
+	cache->epoch++;
+}
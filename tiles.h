@@ -0,0 +1,54 @@
+#ifndef MU_TILES_H
+#define MU_TILES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <xcb/xcb.h>
+
+#include "util/error.h"
+
+#define MU_TILE_SIZE 256
+#define MU_TILE_BUDGET (64 << 20)
+
+/*
+ * A tile of the view scaled by 2^-shift, at column tx and row ty.
+ * epoch changes whenever the view being tiled does.
+ */
+struct mu_tile_key {
+	unsigned int shift;
+	size_t tx;
+	size_t ty;
+	unsigned long epoch;
+};
+
+struct mu_tile {
+	struct mu_tile_key key;
+	xcb_pixmap_t pix;
+	uint16_t width;
+	uint16_t height;
+
+	struct mu_tile *prev;
+	struct mu_tile *next;
+};
+
+/*
+ * Server-side tile pixmaps in LRU order, most recently used first.
+ * Tiles are evicted from the tail once their size exceeds budget.
+ */
+struct mu_tile_cache {
+	struct mu_tile *head;
+	struct mu_tile *tail;
+	size_t bytes;
+	size_t budget;
+	unsigned long epoch;
+};
+
+extern bool tile_key_equal(struct mu_tile_key *a, struct mu_tile_key *b);
+extern struct mu_tile *find_tile(struct mu_tile_cache *cache, struct mu_tile_key *key);
+extern int insert_tile(struct mu_error **err, struct mu_tile_cache *cache, xcb_connection_t *c,
+		struct mu_tile_key *key, xcb_pixmap_t pix, uint16_t width, uint16_t height);
+extern void drop_tile(struct mu_tile_cache *cache, xcb_connection_t *c, struct mu_tile *tile);
+extern void flush_tiles(struct mu_tile_cache *cache, xcb_connection_t *c);
+
+#endif
@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "trace.h"
+#include "util/error.h"
+#include "util/time.h"
+
+static struct {
+	FILE *file;
+	pthread_mutex_t lock;
+	uint64_t epoch;
+	pid_t pid;
+	size_t nevents;
+} trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pid_t trace_tid(void)
+{
+	return syscall(SYS_gettid);
+}
+
+// Appends one event; body is the JSON members after the common ones
+static void trace_event(const char *body)
+{
+	pthread_mutex_lock(&trace.lock);
+	if (trace.file) {
+		fprintf(trace.file, "%s\n{\"pid\": %d, \"tid\": %d, %s}",
+				trace.nevents ? "," : "", trace.pid, trace_tid(), body);
+		trace.nevents++;
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
+
+// Timestamps are in us since trace_open()
+static void trace_span(const char *name, uint64_t start, uint64_t end)
+{
+	char body[256];
+
+	snprintf(body, sizeof(body), "\"name\": \"%s\", \"cat\": \"mucrop\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f",
+			name, (start - trace.epoch) / 1e3, (end - start) / 1e3);
+	trace_event(body);
+}
+
+int trace_open(struct mu_error **err, const char *filename)
+{
+	trace.file = fopen(filename, "w");
+	if (trace.file == NULL) {
+		MU_PUSH_ERRF(err, "Could not open trace file %s: %s", filename, strerror(errno));
+		return -1;
+	}
+
+	trace.epoch = monotonic_ns();
+	trace.pid = getpid();
+	trace.nevents = 0;
+	fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", trace.file);
+
+	set_span_sink(trace_span);
+	trace_thread_name("main");
+
+	return 0;
+}
+
+void trace_close(void)
+{
+	if (trace.file == NULL)
+		return;
+
+	trace_counters();
+	set_span_sink(NULL);
+
+	pthread_mutex_lock(&trace.lock);
+	fputs("\n]}\n", trace.file);
+	fclose(trace.file);
+	trace.file = NULL;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+// Labels the calling thread's track
+void trace_thread_name(const char *name)
+{
+	char body[128];
+
+	if (!spans_enabled())
+		return;
+
+	snprintf(body, sizeof(body), "\"name\": \"thread_name\", \"ph\": \"M\", \"args\": {\"name\": \"%s\"}", name);
+	trace_event(body);
+}
+
+// Samples ImageMagick's resource usage into a counter track
+void trace_counters(void)
+{
+	char body[256];
+
+	if (!spans_enabled())
+		return;
+
+	snprintf(body, sizeof(body), "\"name\": \"magick\", \"ph\": \"C\", \"ts\": %.3f, \"args\": "
+			"{\"memory\": %llu, \"map\": %llu, \"disk\": %llu, \"threads\": %llu}",
+			(monotonic_ns() - trace.epoch) / 1e3,
+			(unsigned long long)MagickGetResource(MemoryResource),
+			(unsigned long long)MagickGetResource(MapResource),
+			(unsigned long long)MagickGetResource(DiskResource),
+			(unsigned long long)MagickGetResource(ThreadResource));
+	trace_event(body);
+}
@@ -0,0 +1,16 @@
+#ifndef MU_TRACE_H
+#define MU_TRACE_H
+
+#include "util/error.h"
+
+/*
+ * Writes the spans from util/time.h to a Chrome trace-event JSON file, for
+ * chrome://tracing or Perfetto. Everything here is a no-op until trace_open().
+ */
+extern int trace_open(struct mu_error **err, const char *filename);
+extern void trace_close(void);
+
+extern void trace_thread_name(const char *name);
+extern void trace_counters(void);
+
+#endif
@@ -111,6 +111,16 @@ void push_errf(struct mu_error **list, const char *file, const char *func, uint_
 }
 
 int process_errors(struct mu_error *list)
+{
+	if (list->ret == 0) {
+		return 0;
+	}
+
+	fputs("Encountered fatal error during processing: \n", stderr);
+	return report_errors(list);
+}
+
+int report_errors(struct mu_error *list)
 {
 	struct mu_error *elem = list;
 	int ret = 0;
@@ -119,7 +129,6 @@ int process_errors(struct mu_error *list)
 		return ret;
 	}
 
-	fputs("Encountered fatal error during processing: \n", stderr);
 	do {
 		ret = -1;
 		fprintf(stderr, "\t%s:%"  PRIuLEAST16 " in %s, %s\n", elem->file, elem->line, elem->func, elem->errmsg);
@@ -128,3 +137,13 @@ int process_errors(struct mu_error *list)
 
 	return ret;
 }
+
+void clear_errors(struct mu_error *list)
+{
+	struct mu_error *elem = list;
+
+	do {
+		elem->ret = 0;
+		elem = elem->next;
+	} while (elem != list);
+}
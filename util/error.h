@@ -33,6 +33,8 @@ struct mu_error {
 
 extern struct mu_error *create_errlist(size_t siz);
 extern int process_errors(struct mu_error *list);
+extern int report_errors(struct mu_error *list);
+extern void clear_errors(struct mu_error *list);
 extern void free_errlist(struct mu_error **list);
 
 extern void push_error(struct mu_error **list, const char *file, const char *func, uint_least16_t line, const char *errmsg, int ret);
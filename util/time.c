@@ -1,22 +1,49 @@
 #define _POSIX_C_SOURCE 199309L
+#include <stdint.h>
 #include <time.h>
 
+#include "time.h"
+
+static mu_span_sink span_sink;
+
+/*
+ * Converts a duration in ms to a timespec
+ */
+void ms_to_timespec(struct timespec *ts, unsigned int ms)
+{
+	ts->tv_sec = ms / 1000;
+	ts->tv_nsec = (long)(ms % 1000) * 1000000L;
+}
+
 /*
- * Returns the difference between two timespecs in ms
- * x _must_ be larger than y otherwise the result is undefined
+ * Returns the current CLOCK_MONOTONIC time in ns
  */
-int difftimespec(struct timespec *x, struct timespec *y)
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void set_span_sink(mu_span_sink sink)
+{
+	span_sink = sink;
+}
+
+int spans_enabled(void)
+{
+	return span_sink != NULL;
+}
+
+void span_begin(struct mu_span *span, const char *name)
+{
+	span->name = name;
+	span->start = span_sink ? monotonic_ns() : 0;
+}
+
+void span_end(struct mu_span *span)
 {
-	int ret = 0;
-	time_t tv_sec = x->tv_sec - y->tv_sec;
-
-	if (x->tv_nsec < y->tv_nsec) {
-		ret = (x->tv_nsec + (1e9) - y->tv_nsec) / 1e6;
-		tv_sec -= 1;
-	} else {
-		ret = (x->tv_nsec - y->tv_nsec) / 1e6;
-	}
-	ret += tv_sec * 1e3;
-
-	return ret;
+	if (span_sink && span->start)
+		span_sink(span->name, span->start, monotonic_ns());
 }
@@ -1,10 +1,37 @@
 #ifndef MU_TIME_H
 #define MU_TIME_H
 
+#include <stdint.h>
+
+/*
+ * Converts a duration in ms to a timespec
+ */
+extern void ms_to_timespec(struct timespec *ts, unsigned int ms);
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in ns
+ */
+extern uint64_t monotonic_ns(void);
+
+/*
+ * A named interval on CLOCK_MONOTONIC. Spans only read the clock while a sink
+ * is installed, and hand their start and end times to it when they end.
+ */
+struct mu_span {
+	const char *name;
+	uint64_t start;
+};
+
+typedef void (*mu_span_sink)(const char *name, uint64_t start, uint64_t end);
+
 /*
- * Returns the difference between two timespecs in ms
- * x _must_ be larger than y otherwise the result is undefined
+ * Installs the sink that receives finished spans, NULL disables them. Not
+ * synchronized, set it before starting any threads.
  */
-extern int difftimespec(struct timespec *x, struct timespec *y);
+extern void set_span_sink(mu_span_sink sink);
+extern int spans_enabled(void);
+
+extern void span_begin(struct mu_span *span, const char *name);
+extern void span_end(struct mu_span *span);
 
 #endif
@@ -0,0 +1,18 @@
+#ifndef MU_WAND_H
+#define MU_WAND_H
+
+#include <MagickWand/MagickWand.h>
+
+#include "error.h"
+
+#define RaiseWandException(wand, errlist) \
+{ \
+	char *description; \
+	ExceptionType severity; \
+\
+	description = MagickGetException(wand, &severity); \
+	MU_PUSH_ERRSTR(errlist, description); \
+	description = (char *) MagickRelinquishMemory(description); \
+}
+
+#endif
@@ -3,15 +3,24 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
 #include <xcb/xcb.h>
+#include <xcb/present.h>
+#include <xcb/render.h>
+#include <xcb/shm.h>
 #include <xcb/xcb_image.h>
+#include <xcb/xfixes.h>
 
 #include <xkbcommon/xkbcommon.h>
 #include <xkbcommon/xkbcommon-x11.h>
 
+#include "pixfmt.h"
 #include "window.h"
 #include "util/error.h"
 #include "util/mem.h"
+#include "util/time.h"
 
 void scale_to_window(size_t *width, size_t *height, size_t w_width, size_t w_height)
 {
@@ -95,6 +104,264 @@ void deinit_xkb(struct mu_window *window)
 	}
 }
 
+/*
+ * MIT-SHM is only usable when the server shares our memory, so it is probed
+ * here and again on the first attach; either failure leaves the socket path.
+ */
+static void init_shm(struct mu_window *window)
+{
+	const xcb_query_extension_reply_t *ext;
+	xcb_shm_query_version_reply_t *version;
+
+	window->shm.available = 0;
+	for (int i = 0; i < MU_SHM_SEGMENTS; i++)
+		window->shm.segs[i].id = -1;
+
+	ext = xcb_get_extension_data(window->c, &xcb_shm_id);
+	if (ext == NULL || !ext->present)
+		return;
+
+	version = xcb_shm_query_version_reply(window->c, xcb_shm_query_version(window->c), NULL);
+	if (version == NULL)
+		return;
+	free(version);
+
+	window->shm.first_event = ext->first_event;
+	window->shm.available = 1;
+}
+
+/*
+ * Present shows a pixmap in place of the window contents at the next vertical
+ * blank. Without it frames are copied to the window directly.
+ */
+static void init_present(struct mu_window *window)
+{
+	const xcb_query_extension_reply_t *ext;
+	xcb_present_query_version_reply_t *version;
+	xcb_xfixes_query_version_reply_t *xfixes;
+
+	window->present.available = 0;
+
+	ext = xcb_get_extension_data(window->c, &xcb_present_id);
+	if (ext == NULL || !ext->present)
+		return;
+
+	version = xcb_present_query_version_reply(window->c,
+			xcb_present_query_version(window->c, XCB_PRESENT_MAJOR_VERSION, XCB_PRESENT_MINOR_VERSION), NULL);
+	if (version == NULL)
+		return;
+	free(version);
+
+	window->present.opcode = ext->major_opcode;
+	window->present.available = 1;
+
+	// Update regions are XFixes regions; without them every frame updates the whole window
+	ext = xcb_get_extension_data(window->c, &xcb_xfixes_id);
+	if (ext == NULL || !ext->present)
+		return;
+	xfixes = xcb_xfixes_query_version_reply(window->c,
+			xcb_xfixes_query_version(window->c, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION), NULL);
+	if (xfixes == NULL)
+		return;
+	free(xfixes);
+
+	window->present.update = xcb_generate_id(window->c);
+	xcb_xfixes_create_region(window->c, window->present.update, 0, NULL);
+	window->present.xfixes = 1;
+}
+
+// Looks up the picture format of a visual
+static xcb_render_pictformat_t find_format(xcb_render_query_pict_formats_reply_t *formats, xcb_visualid_t visual)
+{
+	xcb_render_pictscreen_iterator_t si;
+	xcb_render_pictdepth_iterator_t di;
+	xcb_render_pictvisual_iterator_t vi;
+
+	for (si = xcb_render_query_pict_formats_screens_iterator(formats); si.rem; xcb_render_pictscreen_next(&si)) {
+		for (di = xcb_render_pictscreen_depths_iterator(si.data); di.rem; xcb_render_pictdepth_next(&di)) {
+			for (vi = xcb_render_pictdepth_visuals_iterator(di.data); vi.rem; xcb_render_pictvisual_next(&vi)) {
+				if (vi.data->visual == visual)
+					return vi.data->format;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * XRender lets the server scale the image while drawing a frame. Filters and
+ * transforms need version 0.6.
+ */
+static void init_render(struct mu_window *window)
+{
+	const xcb_query_extension_reply_t *ext;
+	xcb_render_query_version_reply_t *version;
+	xcb_render_query_pict_formats_reply_t *formats;
+	int ok;
+
+	window->render.available = 0;
+
+	ext = xcb_get_extension_data(window->c, &xcb_render_id);
+	if (ext == NULL || !ext->present)
+		return;
+
+	version = xcb_render_query_version_reply(window->c,
+			xcb_render_query_version(window->c, XCB_RENDER_MAJOR_VERSION, XCB_RENDER_MINOR_VERSION), NULL);
+	if (version == NULL)
+		return;
+	ok = version->major_version > 0 || version->minor_version >= 6;
+	free(version);
+	if (!ok)
+		return;
+
+	formats = xcb_render_query_pict_formats_reply(window->c, xcb_render_query_pict_formats(window->c), NULL);
+	if (formats == NULL)
+		return;
+	window->render.format = find_format(formats, window->screen->root_visual);
+	free(formats);
+
+	window->render.available = window->render.format != 0;
+}
+
+static void release_back(struct mu_window *window)
+{
+	for (int i = 0; i < 2; i++) {
+		if (window->render.dst[i])
+			xcb_render_free_picture(window->c, window->render.dst[i]);
+		window->render.dst[i] = 0;
+		if (window->present.back[i])
+			xcb_free_pixmap(window->c, window->present.back[i]);
+		window->present.back[i] = 0;
+		window->present.busy[i] = 0;
+		window->present.damage[i].full = 1;
+	}
+	window->present.width = 0;
+	window->present.height = 0;
+}
+
+// Detaching is ordered after any upload still reading the segment
+static void release_segment(struct mu_window *window, struct mu_shm_segment *s)
+{
+	if (s->addr == NULL)
+		return;
+
+	xcb_shm_detach(window->c, s->seg);
+	shmdt(s->addr);
+	s->addr = NULL;
+	s->size = 0;
+	s->id = -1;
+	s->busy = 0;
+}
+
+static void release_shm(struct mu_window *window)
+{
+	for (int i = 0; i < MU_SHM_SEGMENTS; i++)
+		release_segment(window, &window->shm.segs[i]);
+}
+
+/*
+ * Makes sure the segment can hold size bytes, replacing it if it is too
+ * small. Only a replaced segment costs a round trip, to check the attach.
+ * Disables MIT-SHM for the rest of the session on failure.
+ */
+static int reserve_segment(struct mu_window *window, struct mu_shm_segment *s, size_t size)
+{
+	xcb_generic_error_t *xerr;
+	xcb_void_cookie_t cookie;
+
+	if (s->addr != NULL && s->size >= size)
+		return 0;
+
+	release_segment(window, s);
+
+	s->id = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (s->id == -1)
+		goto fail;
+
+	s->addr = shmat(s->id, NULL, 0);
+	if (s->addr == (void *)-1) {
+		s->addr = NULL;
+		shmctl(s->id, IPC_RMID, NULL);
+		goto fail;
+	}
+
+	s->seg = xcb_generate_id(window->c);
+	cookie = xcb_shm_attach_checked(window->c, s->seg, s->id, 0);
+	xerr = xcb_request_check(window->c, cookie);
+
+	// The server holds its own attachment now, so the id can go away with us
+	shmctl(s->id, IPC_RMID, NULL);
+
+	if (xerr) {
+		free(xerr);
+		shmdt(s->addr);
+		s->addr = NULL;
+		goto fail;
+	}
+	s->size = size;
+
+	return 0;
+
+fail:
+	window->shm.available = 0;
+	s->id = -1;
+	return -1;
+}
+
+// Bytes convert_image() writes for a width x height image
+static size_t native_size(struct mu_window *window, size_t width, size_t height)
+{
+	if (window->fmt.convert)
+		return pixfmt_stride(&window->fmt, width) * height;
+	return width * height * 4;
+}
+
+// Writes BGRA pixels into buf in the server's native layout
+static void convert_image(struct mu_window *window, unsigned char *buf, unsigned char *data, size_t width, size_t height)
+{
+	if (window->fmt.convert)
+		window->fmt.convert(data, buf, width, height, pixfmt_stride(&window->fmt, width));
+	else
+		memcpy(buf, data, width * height * 4);
+}
+
+/*
+ * Uploads through an idle segment without waiting for the server; the
+ * segment stays busy until handle_shm_event() sees its completion. Returns -1
+ * when every segment is still being read, so the caller uses the socket.
+ */
+static int put_image_shm(struct mu_window *window, xcb_drawable_t dst, unsigned char *data, size_t width, size_t height)
+{
+	size_t size = native_size(window, width, height);
+	struct mu_shm_segment *s = NULL;
+
+	// An idle segment that already fits, else any idle one to grow
+	for (int i = 0; i < MU_SHM_SEGMENTS; i++) {
+		struct mu_shm_segment *t = &window->shm.segs[i];
+
+		if (t->busy)
+			continue;
+		if (t->addr != NULL && t->size >= size) {
+			s = t;
+			break;
+		}
+		if (s == NULL)
+			s = t;
+	}
+	if (s == NULL || reserve_segment(window, s, size) != 0)
+		return -1;
+
+	convert_image(window, s->addr, data, width, height);
+
+	xcb_shm_put_image(window->c, dst, window->gc, width, height,
+			0, 0, width, height, 0, 0, window->screen->root_depth,
+			XCB_IMAGE_FORMAT_Z_PIXMAP, 1, s->seg, 0);
+	s->busy = 1;
+
+	return 0;
+}
+
 struct mu_window *create_window(struct mu_error **err, size_t o_width, size_t o_height)
 {
 	struct mu_window *window = mallocz(sizeof(struct mu_window));
@@ -117,6 +384,10 @@ struct mu_window *create_window(struct mu_error **err, size_t o_width, size_t o_
 		return NULL;
 	}
 	window->screen = xcb_setup_roots_iterator(xcb_get_setup(window->c)).data;
+	init_pixfmt(&window->fmt, xcb_get_setup(window->c), window->screen);
+	init_shm(window);
+	init_present(window);
+	init_render(window);
 
 	ret = init_xkb(window);
 	if (ret != 0) {
@@ -134,7 +405,7 @@ struct mu_window *create_window(struct mu_error **err, size_t o_width, size_t o_
 	mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
 	values[0] = window->screen->black_pixel;
 	values[1] = XCB_EVENT_MASK_KEY_PRESS | XCB_EVENT_MASK_BUTTON_PRESS |
-		XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_BUTTON_1_MOTION |
+		XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_BUTTON_1_MOTION | XCB_EVENT_MASK_BUTTON_2_MOTION |
 		XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_STRUCTURE_NOTIFY;
 
 	window->width = o_width;
@@ -154,6 +425,12 @@ struct mu_window *create_window(struct mu_error **err, size_t o_width, size_t o_
 		return NULL;
 	}
 
+	if (window->present.available) {
+		window->present.eid = xcb_generate_id(window->c);
+		xcb_present_select_input(window->c, window->present.eid, window->win,
+				XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY | XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+	}
+
 	return window;
 }
 
@@ -183,6 +460,13 @@ void destroy_window(struct mu_window **window)
 {
 	struct mu_window *w = *window;
 
+	release_shm(w);
+	release_back(w);
+	if (w->present.xfixes)
+		xcb_xfixes_destroy_region(w->c, w->present.update);
+	if (w->render.src)
+		xcb_render_free_picture(w->c, w->render.src);
+	free(w->scratch);
 	if (w->gc)
 		xcb_free_gc(w->c, w->gc);
 	if (w->pix)
@@ -214,45 +498,87 @@ int create_gc(struct mu_error **err, struct mu_window *window)
 
 int create_pixmap(struct mu_error **err, struct mu_window *window, size_t width, size_t height)
 {
+	// The picture belongs to the pixmap being replaced
+	if (window->render.src) {
+		xcb_render_free_picture(window->c, window->render.src);
+		window->render.src = 0;
+	}
+
 	window->pix = xcb_generate_id(window->c);
+	window->pix_width = width;
+	window->pix_height = height;
 
 	xcb_create_pixmap(window->c, window->screen->root_depth, window->pix, window->win, width, height);
 
 	return 0;
 }
 
-static int draw_image(struct mu_error **err, struct mu_window *window, uint16_t loc[4], size_t im_width, size_t im_height)
+static void add_damage(struct mu_window *window, struct mu_damage *d, int32_t x, int32_t y, int32_t width, int32_t height)
 {
-	uint16_t src_x = loc[0], dst_x = src_x, src_y = loc[1], dst_y = src_y, c_width = loc[2], c_height = loc[3];
-
-	if (src_x < window->xoff && c_width > window->xoff) {
-		dst_x += window->xoff;
-		c_width -= window->xoff;
-	} else if (src_x < window->xoff || src_x > im_width + window->xoff) {
-		return 0;
-	} else {
-		src_x -= window->xoff;
+	int32_t x1 = x + width, y1 = y + height;
+
+	if (d->full)
+		return;
+	if (x < 0)
+		x = 0;
+	if (y < 0)
+		y = 0;
+	if (x1 > (int32_t)window->width)
+		x1 = window->width;
+	if (y1 > (int32_t)window->height)
+		y1 = window->height;
+	if (x1 <= x || y1 <= y)
+		return;
+
+	if (d->n == MU_DAMAGE_RECTS) {
+		d->full = 1;
+		return;
 	}
+	d->rects[d->n++] = (xcb_rectangle_t){ x, y, x1 - x, y1 - y };
+}
 
-	if (src_y < window->yoff && c_height > window->yoff) {
-		dst_y += window->yoff;
-		c_height -= window->yoff;
-	} else if (src_y < window->yoff || src_y > im_height + window->yoff) {
-		return 0;
-	} else {
-		src_y -= window->yoff;
-	}
+// Marks a window-space rectangle as changed in both back buffers and on the window
+static void damage_area(struct mu_window *window, int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	add_damage(window, &window->present.damage[0], x, y, width, height);
+	add_damage(window, &window->present.damage[1], x, y, width, height);
+	add_damage(window, &window->present.shown, x, y, width, height);
+}
 
-	xcb_copy_area(window->c, window->pix, window->win, window->gc, src_x, src_y, dst_x, dst_y, c_width, c_height);
-	xcb_flush(window->c);
+static void damage_all(struct mu_window *window)
+{
+	window->present.damage[0].full = 1;
+	window->present.damage[1].full = 1;
+	window->present.shown.full = 1;
+}
 
-	return 0;
+// The four one pixel edges of the bounding box, as drawn by xcb_poly_rectangle
+static void damage_bbox(struct mu_window *window)
+{
+	xcb_rectangle_t *r = &window->bbox;
+
+	if (!window->has_bbox)
+		return;
+
+	damage_area(window, r->x, r->y, r->width + 1, 1);
+	damage_area(window, r->x, r->y + r->height, r->width + 1, 1);
+	damage_area(window, r->x, r->y, 1, r->height + 1);
+	damage_area(window, r->x + r->width, r->y, 1, r->height + 1);
 }
 
-static int reload_with_offset(struct mu_error **err, struct mu_window *window, size_t width, size_t height)
+static int has_damage(struct mu_damage *d)
 {
-	uint16_t loc[4] = { 0, 0, window->width, window->height };
+	return d->full || d->n > 0;
+}
 
+static void clear_damage(struct mu_damage *d)
+{
+	d->full = 0;
+	d->n = 0;
+}
+
+static int reload_with_offset(struct mu_error **err, struct mu_window *window, size_t width, size_t height)
+{
 	if (width < window->width)
 		window->xoff = (window->width - width) / 2;
 	else
@@ -262,23 +588,54 @@ static int reload_with_offset(struct mu_error **err, struct mu_window *window, s
 	else
 		window->yoff = 0;
 
-	xcb_clear_area(window->c, 0, window->win, 0, 0, window->width, window->height);
+	window->im_width = width;
+	window->im_height = height;
+	window->has_bbox = 0;
+	damage_all(window);
 
-	return draw_image(err, window, loc, width, height);
+	return 0;
 }
 
+/*
+ * Uploads a BGRA image into dst at 0,0. Over MIT-SHM the conversion writes
+ * straight into the segment, otherwise into a scratch buffer kept for reuse.
+ */
+static void put_image(struct mu_window *window, xcb_drawable_t dst, unsigned char *data, size_t len, size_t width, size_t height)
+{
+	struct mu_span span;
+	xcb_image_t *img;
+
+	span_begin(&span, "upload");
+	if (!window->shm.available || put_image_shm(window, dst, data, width, height) != 0) {
+		if (window->fmt.convert) {
+			len = native_size(window, width, height);
+			if (window->scratch_size < len) {
+				free(window->scratch);
+				window->scratch = malloc(len);
+				window->scratch_size = window->scratch ? len : 0;
+			}
+			if (window->scratch == NULL)
+				goto out;
+			convert_image(window, window->scratch, data, width, height);
+			data = window->scratch;
+		}
+
+		// No base pointer, otherwise xcb_image_destroy() frees the caller's buffer
+		img = xcb_image_create_native(window->c, width, height, XCB_IMAGE_FORMAT_Z_PIXMAP, window->screen->root_depth, NULL, len, data);
+		xcb_image_put(window->c, dst, window->gc, img, 0, 0, 0);
+		xcb_image_destroy(img);
+	}
+out:
+	span_end(&span);
+}
+
+// Nothing on screen changes until the next present_frame()
 int load_image(struct mu_error **err, struct mu_window *window, unsigned char *data, size_t len, size_t width, size_t height)
 {
 	xcb_pixmap_t old_pix = window->pix;
-	xcb_image_t *img;
 
-	// Recreate pixmap here
-	// Create some sort of backing pixmap and then swap them "atomically"?
 	create_pixmap(err, window, width, height);
-
-	img = xcb_image_create_native(window->c, width, height, XCB_IMAGE_FORMAT_Z_PIXMAP, window->screen->root_depth, data, len, data);
-	xcb_image_put(window->c, window->pix, window->gc, img, 0, 0, 0);
-	xcb_image_destroy(img);
+	put_image(window, window->pix, data, len, width, height);
 
 	reload_with_offset(err, window, width, height);
 	xcb_free_pixmap(window->c, old_pix);
@@ -286,11 +643,90 @@ int load_image(struct mu_error **err, struct mu_window *window, unsigned char *d
 	return 0;
 }
 
+// Uploads a BGRA image into a new pixmap of its own, e.g. a zoom tile
+xcb_pixmap_t upload_pixmap(struct mu_error **err, struct mu_window *window, unsigned char *data, size_t len, size_t width, size_t height)
+{
+	xcb_pixmap_t pix = xcb_generate_id(window->c);
+
+	xcb_create_pixmap(window->c, window->screen->root_depth, pix, window->win, width, height);
+	put_image(window, pix, data, len, width, height);
+
+	return pix;
+}
+
+// Copies the backing pixmap into a new one, e.g. to show it again later
+xcb_pixmap_t copy_pixmap(struct mu_window *window)
+{
+	xcb_pixmap_t pix = xcb_generate_id(window->c);
+
+	xcb_create_pixmap(window->c, window->screen->root_depth, pix, window->win, window->pix_width, window->pix_height);
+	xcb_copy_area(window->c, window->pix, pix, window->gc, 0, 0, 0, 0, window->pix_width, window->pix_height);
+
+	return pix;
+}
+
+// Shows a width x height image kept in pix; the copy stays on the server
+int show_pixmap(struct mu_error **err, struct mu_window *window, xcb_pixmap_t pix, size_t width, size_t height)
+{
+	if (window->pix_width != width || window->pix_height != height) {
+		xcb_pixmap_t old_pix = window->pix;
+
+		create_pixmap(err, window, width, height);
+		xcb_free_pixmap(window->c, old_pix);
+	}
+	xcb_copy_area(window->c, pix, window->pix, window->gc, 0, 0, 0, 0, width, height);
+
+	return reload_with_offset(err, window, width, height);
+}
+
+/*
+ * Starts composing a width x height view from tiles: makes sure the backing
+ * pixmap has that size and clears it.
+ */
+int begin_view(struct mu_error **err, struct mu_window *window, size_t width, size_t height)
+{
+	xcb_rectangle_t rect = { 0, 0, width, height };
+
+	if (window->pix_width != width || window->pix_height != height) {
+		xcb_pixmap_t old_pix = window->pix;
+
+		create_pixmap(err, window, width, height);
+		xcb_free_pixmap(window->c, old_pix);
+	}
+	xcb_poly_fill_rectangle(window->c, window->pix, window->gc, 1, &rect);
+
+	return 0;
+}
+
+void blit_tile(struct mu_window *window, xcb_pixmap_t tile, int16_t x, int16_t y, uint16_t width, uint16_t height)
+{
+	xcb_copy_area(window->c, tile, window->pix, window->gc, 0, 0, x, y, width, height);
+}
+
+/*
+ * Shows the current image at width x height, scaled by the server when that
+ * differs from its size. Fails without XRender.
+ */
+int scale_image(struct mu_error **err, struct mu_window *window, size_t width, size_t height)
+{
+	if (!window->render.available && (width != window->pix_width || height != window->pix_height))
+		MU_RET_ERRSTR(err, "XRender is not available");
+
+	return reload_with_offset(err, window, width, height);
+}
+
+// Shows the composed view, centered like a loaded image
+int present_view(struct mu_error **err, struct mu_window *window, size_t width, size_t height)
+{
+	return reload_with_offset(err, window, width, height);
+}
+
+// The back buffers are intact, only the window needs the exposed area again
 int handle_expose(struct mu_error **err, struct mu_window *window, size_t width, size_t height, xcb_expose_event_t *ev)
 {
-	uint16_t loc[4] = { ev->x, ev->y, ev->width, ev->height };
+	add_damage(window, &window->present.shown, ev->x, ev->y, ev->width, ev->height);
 
-	return draw_image(err, window, loc, width, height);
+	return 0;
 }
 
 int resize_window(struct mu_error **err, struct mu_window *window, size_t sizes[4], xcb_configure_notify_event_t *ev)
@@ -326,30 +762,200 @@ int resize_window(struct mu_error **err, struct mu_window *window, size_t sizes[
 int draw_bbox(struct mu_error **err, struct mu_window *window, Point *p1, Point *p2)
 {
 	xcb_rectangle_t rect = { 0, 0, abs(p2->x - p1->x), abs(p2->y - p1->y) };
-	uint16_t loc[4] = { 0, 0, window->width, window->height };
 
 	rect.x = p2->x > p1->x ? p1->x : p2->x;
 	rect.y = p2->y > p1->y ? p1->y : p2->y;
-	loc[0] = 0;
-	loc[1] = 0;
 
-	// TODO: maybe optimize this by storing the last box size/pos and only clearing that
-	draw_image(err, window, loc, window->width, window->height);
-
-	xcb_poly_rectangle(window->c, window->win, window->gc, 1, &rect);
-	xcb_flush(window->c);
+	damage_bbox(window);
+	window->bbox = rect;
+	window->has_bbox = 1;
+	damage_bbox(window);
 
 	return 0;
 }
 
 int clear_bbox(struct mu_error **err, struct mu_window *window, Point *p1, Point *p2)
 {
-	uint16_t loc[4] = { 0, 0, window->width, window->height };
 	(void)p1;
 	(void)p2;
 
-	draw_image(err, window, loc, window->width, window->height);
-	xcb_flush(window->c);
+	damage_bbox(window);
+	window->has_bbox = 0;
+
+	return 0;
+}
+
+/*
+ * Draws the x0,y0 - x1,y1 part of the image, scaled to im_width x im_height,
+ * into back buffer i; bilinear with edges padded.
+ */
+static void render_scaled(struct mu_window *window, int i, int32_t x0, int32_t y0, int32_t x1, int32_t y1)
+{
+	struct mu_render *r = &window->render;
+	uint32_t repeat = XCB_RENDER_REPEAT_PAD;
+	xcb_render_transform_t transform = {
+		.matrix11 = ((double)window->pix_width / window->im_width) * 65536,
+		.matrix22 = ((double)window->pix_height / window->im_height) * 65536,
+		.matrix33 = 65536
+	};
+
+	if (r->src == 0) {
+		r->src = xcb_generate_id(window->c);
+		xcb_render_create_picture(window->c, r->src, window->pix, r->format, XCB_RENDER_CP_REPEAT, &repeat);
+		xcb_render_set_picture_filter(window->c, r->src, strlen("good"), "good", 0, NULL);
+	}
+	if (r->dst[i] == 0) {
+		r->dst[i] = xcb_generate_id(window->c);
+		xcb_render_create_picture(window->c, r->dst[i], window->present.back[i], r->format, 0, NULL);
+	}
+
+	xcb_render_set_picture_transform(window->c, r->src, transform);
+	xcb_render_composite(window->c, XCB_RENDER_PICT_OP_SRC, r->src, 0, r->dst[i],
+			x0 - window->xoff, y0 - window->yoff, 0, 0, x0, y0, x1 - x0, y1 - y0);
+}
+
+// Repaints a window-space rectangle of back buffer i: the image where it covers it, black elsewhere
+static void render_area(struct mu_window *window, int i, const xcb_rectangle_t *rect)
+{
+	xcb_pixmap_t dst = window->present.back[i];
+	int32_t ix0 = window->xoff, iy0 = window->yoff;
+	int32_t ix1 = ix0 + window->im_width, iy1 = iy0 + window->im_height;
+	int32_t x0 = rect->x, y0 = rect->y, x1 = rect->x + rect->width, y1 = rect->y + rect->height;
+
+	if (x0 < ix0 || y0 < iy0 || x1 > ix1 || y1 > iy1)
+		xcb_poly_fill_rectangle(window->c, dst, window->gc, 1, rect);
+
+	if (x0 < ix0)
+		x0 = ix0;
+	if (y0 < iy0)
+		y0 = iy0;
+	if (x1 > ix1)
+		x1 = ix1;
+	if (y1 > iy1)
+		y1 = iy1;
+	if (x1 <= x0 || y1 <= y0)
+		return;
+
+	if (window->im_width == window->pix_width && window->im_height == window->pix_height)
+		xcb_copy_area(window->c, window->pix, dst, window->gc, x0 - ix0, y0 - iy0, x0, y0, x1 - x0, y1 - y0);
+	else if (window->render.available)
+		render_scaled(window, i, x0, y0, x1, y1);
+}
+
+// Brings back buffer i up to date by repainting its damage only, then draws the bounding box
+static void render_frame(struct mu_window *window, int i)
+{
+	struct mu_damage *d = &window->present.damage[i];
+	xcb_rectangle_t all = { 0, 0, window->width, window->height };
+
+	if (d->full) {
+		render_area(window, i, &all);
+	} else {
+		for (size_t k = 0; k < d->n; k++)
+			render_area(window, i, &d->rects[k]);
+	}
+	clear_damage(d);
+
+	if (window->has_bbox)
+		xcb_poly_rectangle(window->c, window->present.back[i], window->gc, 1, &window->bbox);
+}
+
+/*
+ * Shows the window as it stands if anything changed since the last frame.
+ * With Present only one frame is in flight and a back buffer is only drawn
+ * once the server is done with it; until then changes pile up into the next
+ * frame rather than queueing behind the display. Does not flush.
+ */
+int present_frame(struct mu_error **err, struct mu_window *window)
+{
+	struct mu_present *p = &window->present;
+	struct mu_span span;
+	int i;
+
+	if (!has_damage(&p->shown) || p->in_flight || window->pix == 0)
+		return 0;
+
+	if (p->width != window->width || p->height != window->height) {
+		release_back(window);
+		for (i = 0; i < (p->available ? 2 : 1); i++) {
+			p->back[i] = xcb_generate_id(window->c);
+			xcb_create_pixmap(window->c, window->screen->root_depth, p->back[i], window->win,
+					window->width, window->height);
+		}
+		p->width = window->width;
+		p->height = window->height;
+	}
+
+	if (!p->busy[0])
+		i = 0;
+	else if (p->available && !p->busy[1])
+		i = 1;
+	else
+		return 0;
+
+	span_begin(&span, "present");
+	render_frame(window, i);
+	if (p->available) {
+		uint32_t update = 0;
+
+		if (p->xfixes && !p->shown.full) {
+			xcb_xfixes_set_region(window->c, p->update, p->shown.n, p->shown.rects);
+			update = p->update;
+		}
+		xcb_present_pixmap(window->c, window->win, p->back[i], ++p->serial, 0, update, 0, 0, 0, 0, 0,
+				XCB_PRESENT_OPTION_NONE, 0, 0, 0, 0, NULL);
+		p->busy[i] = 1;
+		p->in_flight = 1;
+	} else if (p->shown.full) {
+		xcb_copy_area(window->c, p->back[i], window->win, window->gc, 0, 0, 0, 0, window->width, window->height);
+	} else {
+		for (size_t k = 0; k < p->shown.n; k++) {
+			xcb_rectangle_t *r = &p->shown.rects[k];
+
+			xcb_copy_area(window->c, p->back[i], window->win, window->gc, r->x, r->y, r->x, r->y, r->width, r->height);
+		}
+	}
+	clear_damage(&p->shown);
+	span_end(&span);
 
 	return 0;
 }
+
+// Returns 1 if ev was a ShmCompletion, which frees up its segment for reuse
+int handle_shm_event(struct mu_window *window, xcb_generic_event_t *ev)
+{
+	xcb_shm_completion_event_t *done = (xcb_shm_completion_event_t *)ev;
+
+	if (!window->shm.available || (ev->response_type & ~0x80) != window->shm.first_event + XCB_SHM_COMPLETION)
+		return 0;
+
+	for (int i = 0; i < MU_SHM_SEGMENTS; i++) {
+		if (window->shm.segs[i].addr != NULL && window->shm.segs[i].seg == done->shmseg)
+			window->shm.segs[i].busy = 0;
+	}
+
+	return 1;
+}
+
+// Returns 1 if ev was a Present event, which frees up the next frame
+int handle_present_event(struct mu_window *window, xcb_generic_event_t *ev)
+{
+	xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)ev;
+	struct mu_present *p = &window->present;
+
+	if (!p->available || (ev->response_type & ~0x80) != XCB_GE_GENERIC || ge->extension != p->opcode)
+		return 0;
+
+	if (ge->event_type == XCB_PRESENT_EVENT_COMPLETE_NOTIFY) {
+		p->in_flight = 0;
+	} else if (ge->event_type == XCB_PRESENT_EVENT_IDLE_NOTIFY) {
+		xcb_present_idle_notify_event_t *idle = (xcb_present_idle_notify_event_t *)ev;
+
+		for (int i = 0; i < 2; i++) {
+			if (p->back[i] == idle->pixmap)
+				p->busy[i] = 0;
+		}
+	}
+
+	return 1;
+}
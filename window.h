@@ -2,9 +2,77 @@
 #define MU_WINDOW_H
 
 #include <xcb/xcb.h>
+#include <xcb/render.h>
+#include <xcb/shm.h>
 
+#include "pixfmt.h"
 #include "util/error.h"
 
+// Uploads in flight at once before falling back to the socket
+#define MU_SHM_SEGMENTS 4
+
+// A shared segment, busy until the server's ShmCompletion for it arrives
+struct mu_shm_segment {
+	xcb_shm_seg_t seg;
+	int id;
+	uint8_t *addr;
+	size_t size;
+	int busy;
+};
+
+struct mu_shm {
+	struct mu_shm_segment segs[MU_SHM_SEGMENTS];
+	uint8_t first_event;
+	int available;
+};
+
+// Rectangles past this many are merged into a repaint of the whole window
+#define MU_DAMAGE_RECTS 32
+
+// Window-space rectangles to repaint, or all of the window if full is set
+struct mu_damage {
+	xcb_rectangle_t rects[MU_DAMAGE_RECTS];
+	size_t n;
+	int full;
+};
+
+/*
+ * Frames are drawn into a back buffer and shown with the Present extension,
+ * flipping between two buffers, or by copying the one buffer to the window
+ * without it. Each back buffer keeps the damage it has not been redrawn for
+ * yet, so a dragged box only repaints its old and new edges; shown is what
+ * the next frame changes on the window, passed to Present as its update
+ * region.
+ */
+struct mu_present {
+	int available;
+	uint8_t opcode;
+	uint32_t eid;
+	uint32_t serial;
+	int xfixes;
+	uint32_t update;
+
+	xcb_pixmap_t back[2];
+	int busy[2];
+	size_t width;
+	size_t height;
+	struct mu_damage damage[2];
+	struct mu_damage shown;
+
+	int in_flight;
+};
+
+/*
+ * Server-side scaling of the image pixmap through XRender. src is the
+ * picture of the current pixmap, dst those of the back buffers.
+ */
+struct mu_render {
+	int available;
+	xcb_render_pictformat_t format;
+	xcb_render_picture_t src;
+	xcb_render_picture_t dst[2];
+};
+
 typedef struct Point {
 	int16_t x;
 	int16_t y;
@@ -15,8 +83,17 @@ struct mu_window {
 	xcb_screen_t     *screen;
 	xcb_drawable_t   win;
 	xcb_pixmap_t     pix;
+	size_t           pix_width;
+	size_t           pix_height;
 	xcb_gcontext_t   gc;
 
+	struct mu_shm shm;
+	struct mu_present present;
+	struct mu_render render;
+	struct mu_pixfmt fmt;
+	unsigned char *scratch;
+	size_t scratch_size;
+
 	struct xkb_context *xkb;
 	struct xkb_keymap *keymap;
 	struct xkb_state *keyboard_state;
@@ -25,6 +102,13 @@ struct mu_window {
 	size_t height;
 	int16_t xoff;
 	int16_t yoff;
+
+	// Size the image is shown at, which differs from the pixmap's when the server scales it
+	size_t im_width;
+	size_t im_height;
+
+	xcb_rectangle_t bbox;
+	int has_bbox;
 };
 
 extern struct mu_window *create_window(struct mu_error **err, size_t width, size_t height);
@@ -41,7 +125,18 @@ extern int draw_bbox(struct mu_error **err, struct mu_window *window, Point *p1,
 extern int clear_bbox(struct mu_error **err, struct mu_window *window, Point *p1, Point *p2);
 
 extern int load_image(struct mu_error **err, struct mu_window *window, unsigned char *data, size_t len, size_t width, size_t height);
+extern xcb_pixmap_t upload_pixmap(struct mu_error **err, struct mu_window *window, unsigned char *data, size_t len, size_t width, size_t height);
+extern xcb_pixmap_t copy_pixmap(struct mu_window *window);
+extern int show_pixmap(struct mu_error **err, struct mu_window *window, xcb_pixmap_t pix, size_t width, size_t height);
+
+extern int begin_view(struct mu_error **err, struct mu_window *window, size_t width, size_t height);
+extern void blit_tile(struct mu_window *window, xcb_pixmap_t tile, int16_t x, int16_t y, uint16_t width, uint16_t height);
+extern int scale_image(struct mu_error **err, struct mu_window *window, size_t width, size_t height);
+extern int present_view(struct mu_error **err, struct mu_window *window, size_t width, size_t height);
 extern int handle_expose(struct mu_error **err, struct mu_window *window, size_t width, size_t height, xcb_expose_event_t *ev);
+extern int present_frame(struct mu_error **err, struct mu_window *window);
+extern int handle_present_event(struct mu_window *window, xcb_generic_event_t *ev);
+extern int handle_shm_event(struct mu_window *window, xcb_generic_event_t *ev);
 extern int resize_window(struct mu_error **err, struct mu_window *window, size_t sizes[4], xcb_configure_notify_event_t *ev);
 
 #endif
@@ -0,0 +1,431 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "loop.h"
+#include "pool.h"
+#include "pyramid.h"
+#include "scale.h"
+#include "tiled.h"
+#include "trace.h"
+#include "worker.h"
+#include "util/error.h"
+#include "util/time.h"
+#include "util/wand.h"
+
+// Decodes just the tiles of the job's region, box filtered to the target size
+static int render_tiled(struct mu_error **err, struct mu_pyramid *pyr, struct mu_pool *pool, struct mu_job *job,
+		struct mu_result *res, MagickProgressMonitor monitor, void *data)
+{
+	struct mu_span span;
+	int ret;
+
+	res->length = job->width * job->height * 4;
+	res->image = acquire_buffer(pool, res->length);
+	if (res->image == NULL)
+		MU_RET_ERRNO(err, ENOMEM);
+
+	span_begin(&span, "decode_tiles");
+	ret = read_tiff_region(err, pyr->tiled, job->x, job->y, job->s_width, job->s_height,
+			res->image, job->width, job->height, monitor, data);
+	span_end(&span);
+	if (ret != 0) {
+		release_buffer(pool, res->image);
+		res->image = NULL;
+		res->length = 0;
+		return -1;
+	}
+	res->ret = 0;
+
+	return 0;
+}
+
+// Rows exported between two polls of the job's monitor
+#define MU_WORKER_BAND 256
+
+static bool job_aborted(MagickProgressMonitor monitor, void *data)
+{
+	return monitor != NULL && monitor(NULL, 0, 0, data) == MagickFalse;
+}
+
+// Lets downscale_bgra() poll the job's monitor
+struct mu_poll {
+	MagickProgressMonitor monitor;
+	void *data;
+};
+
+static int poll_job(void *data)
+{
+	struct mu_poll *poll = data;
+
+	return job_aborted(poll->monitor, poll->data);
+}
+
+/*
+ * Point samples a region of wand into image, exporting only the source rows
+ * that get sampled rather than the whole region. An aborted job returns -1
+ * without an error.
+ */
+static int sample_level(struct mu_error **err, MagickWand *wand, struct mu_pool *pool, size_t x, size_t y,
+		size_t width, size_t height, unsigned char *image, size_t t_width, size_t t_height,
+		MagickProgressMonitor monitor, void *data)
+{
+	unsigned char *row = acquire_buffer(pool, width * 4);
+
+	if (row == NULL)
+		MU_RET_ERRNO(err, ENOMEM);
+
+	for (size_t j = 0; j < t_height; j++) {
+		if (j % MU_WORKER_BAND == 0 && job_aborted(monitor, data)) {
+			release_buffer(pool, row);
+			return -1;
+		}
+		if (MagickExportImagePixels(wand, x, y + j * height / t_height, width, 1, "BGRA", CharPixel, row) == MagickFalse) {
+			RaiseWandException(wand, err);
+			release_buffer(pool, row);
+			return -1;
+		}
+		sample_bgra(row, width, 1, width * 4, image + j * t_width * 4, t_width, 1, t_width * 4);
+	}
+	release_buffer(pool, row);
+
+	return 0;
+}
+
+/*
+ * Exports the job's region from the smallest sufficient pyramid level and
+ * resamples it into a BGRA buffer from pool, which res then owns. Only the
+ * exported region is touched. A master still pending behind a draft is
+ * decoded the first time a job needs it. monitor is polled during that decode
+ * and between bands of the export and resample; an aborted job returns -1
+ * without an error.
+ */
+int render_job(struct mu_error **err, struct mu_pyramid *pyr, struct mu_pool *pool, struct mu_job *job,
+		struct mu_result *res, MagickProgressMonitor monitor, void *data)
+{
+	size_t x = job->x, y = job->y, width = job->s_width, height = job->s_height;
+	struct mu_poll poll = { monitor, data };
+	size_t level, length;
+	double scale_x, scale_y;
+	unsigned char *pixels = NULL, *image;
+	struct mu_span span;
+	MagickBooleanType status;
+	int ret;
+
+	res->job = *job;
+	res->image = NULL;
+	res->length = 0;
+	res->ret = -1;
+
+	if (pyr->tiled)
+		return render_tiled(err, pyr, pool, job, res, monitor, data);
+
+	level = pyramid_select(pyr, width, height, job->width, job->height);
+	if (level == 0 && pyr->pending) {
+		span_begin(&span, "decode_master");
+		ret = load_master(err, pyr, monitor, data);
+		span_end(&span);
+		if (ret != 0)
+			return -1;
+		level = pyramid_select(pyr, width, height, job->width, job->height);
+	}
+	scale_x = (double)pyr->width[level] / (double)pyr->width[0];
+	scale_y = (double)pyr->height[level] / (double)pyr->height[0];
+
+	if (level > 0) {
+		x *= scale_x;
+		y *= scale_y;
+		width  = width * scale_x + 0.5;
+		height = height * scale_y + 0.5;
+		if (width == 0)
+			width = 1;
+		if (height == 0)
+			height = 1;
+		if (x + width > pyr->width[level])
+			width = pyr->width[level] - x;
+		if (y + height > pyr->height[level])
+			height = pyr->height[level] - y;
+	}
+
+	length = job->width * job->height * 4;
+	image = acquire_buffer(pool, length);
+	if (image == NULL)
+		MU_RET_ERRNO(err, ENOMEM);
+
+	// Previews are scaled here rather than by ImageMagick, only the export goes through the wand
+	if (job->quality == MU_QUALITY_FAST && (job->width != width || job->height != height)) {
+		span_begin(&span, "sample");
+		ret = sample_level(err, pyr->level[level], pool, x, y, width, height, image, job->width, job->height,
+				monitor, data);
+		span_end(&span);
+		if (ret != 0)
+			goto fail;
+		pixels = image;
+		goto done;
+	}
+
+	if (job->width == width && job->height == height) {
+		pixels = image;
+	} else if ((pixels = acquire_buffer(pool, width * height * 4)) == NULL) {
+		release_buffer(pool, image);
+		MU_RET_ERRNO(err, ENOMEM);
+	}
+
+	// In bands, so that an aborted job stops early; that is not an error, the caller checks the generation
+	span_begin(&span, "export");
+	for (size_t j = 0; j < height; j += MU_WORKER_BAND) {
+		size_t n = height - j < MU_WORKER_BAND ? height - j : MU_WORKER_BAND;
+
+		if (job_aborted(monitor, data)) {
+			span_end(&span);
+			goto fail;
+		}
+		status = MagickExportImagePixels(pyr->level[level], x, y + j, width, n, "BGRA", CharPixel,
+				pixels + j * width * 4);
+		if (status == MagickFalse) {
+			span_end(&span);
+			RaiseWandException(pyr->level[level], err);
+			goto fail;
+		}
+	}
+	span_end(&span);
+
+	if (pixels != image) {
+		span_begin(&span, "resize");
+		if (job->width > width || job->height > height) {
+			sample_bgra(pixels, width, height, width * 4, image, job->width, job->height, job->width * 4);
+		} else if ((ret = downscale_bgra(pixels, width, height, width * 4, image, job->width, job->height,
+						job->width * 4, monitor ? poll_job : NULL, &poll)) != 0) {
+			span_end(&span);
+			if (ret < 0)
+				MU_PUSH_ERRNO(err, ENOMEM);
+			goto fail;
+		}
+		span_end(&span);
+		release_buffer(pool, pixels);
+	}
+
+done:
+	res->image = image;
+	res->length = length;
+	res->ret = 0;
+
+	return 0;
+
+fail:
+	if (pixels != image)
+		release_buffer(pool, pixels);
+	release_buffer(pool, image);
+	return -1;
+}
+
+static MagickBooleanType job_monitor(const char *text, const MagickOffsetType offset, const MagickSizeType span, void *data)
+{
+	struct mu_worker *worker = data;
+	MagickBooleanType ret;
+
+	pthread_mutex_lock(&worker->lock);
+	ret = (worker->quit || worker->pending || worker->rendering != worker->generation) ? MagickFalse : MagickTrue;
+	pthread_mutex_unlock(&worker->lock);
+
+	return ret;
+}
+
+// Queues a result, replacing an unconsumed preview if this is a newer one
+static void push_result(struct mu_worker *worker, struct mu_result *res)
+{
+	if (res->job.kind == MU_JOB_PREVIEW) {
+		for (size_t i = 0; i < worker->nresults; i++) {
+			if (worker->results[i].job.kind != MU_JOB_PREVIEW)
+				continue;
+			release_buffer(worker->pool, worker->results[i].image);
+			memmove(worker->results + i, worker->results + i + 1,
+					(worker->nresults - i - 1) * sizeof(struct mu_result));
+			worker->nresults--;
+			break;
+		}
+	}
+
+	worker->results[worker->nresults++] = *res;
+	wake_loop(worker->loop);
+}
+
+static void *worker_main(void *data)
+{
+	struct mu_worker *worker = data;
+	struct mu_result res;
+	struct mu_span span;
+	struct mu_job job;
+	int ret;
+
+	trace_thread_name("worker");
+
+	// Levels are only needed for rescales, so they are built here rather than before the first frame
+	span_begin(&span, "build_pyramid");
+	ret = build_pyramid(&worker->errlist, worker->pyramid);
+	span_end(&span);
+	if (ret != 0) {
+		memset(&res, 0, sizeof(struct mu_result));
+		res.ret = -1;
+		pthread_mutex_lock(&worker->lock);
+		push_result(worker, &res);
+		pthread_mutex_unlock(&worker->lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&worker->lock);
+	for (;;) {
+		while (!worker->quit && (worker->nresults == MU_WORKER_RESULTS || (!worker->pending && !worker->ntiles)))
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		if (worker->quit)
+			break;
+
+		if (worker->pending) {
+			job = worker->job;
+			worker->pending = false;
+			worker->rendering = job.generation;
+		} else {
+			job = worker->tiles[0];
+			memmove(worker->tiles, worker->tiles + 1, --worker->ntiles * sizeof(struct mu_job));
+			worker->running = job.key;
+			worker->running_tile = true;
+		}
+		pthread_mutex_unlock(&worker->lock);
+
+		// Tiles are small, only previews are worth aborting halfway
+		span_begin(&span, job.kind == MU_JOB_PREVIEW ? "render_preview" : "render_tile");
+		render_job(&worker->errlist, worker->pyramid, worker->pool, &job, &res,
+				job.kind == MU_JOB_PREVIEW ? job_monitor : NULL, worker);
+		span_end(&span);
+
+		pthread_mutex_lock(&worker->lock);
+		worker->running_tile = false;
+		if (job.kind == MU_JOB_PREVIEW && job.generation != worker->generation) {
+			// Superseded while running
+			release_buffer(worker->pool, res.image);
+			continue;
+		}
+
+		push_result(worker, &res);
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+int start_worker(struct mu_error **err, struct mu_worker *worker, struct mu_pyramid *pyr, struct mu_pool *pool,
+		struct mu_loop *loop)
+{
+	int ret;
+
+	memset(worker, 0, sizeof(struct mu_worker));
+	worker->pyramid = pyr;
+	worker->pool = pool;
+	worker->loop = loop;
+
+	worker->errlist = create_errlist(1);
+	if (worker->errlist == NULL)
+		MU_RET_ERRNO(err, ENOMEM);
+
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+
+	ret = pthread_create(&worker->thread, NULL, worker_main, worker);
+	if (ret != 0) {
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->lock);
+		free_errlist(&worker->errlist);
+		MU_RET_ERRNO(err, ret);
+	}
+	worker->started = true;
+
+	return 0;
+}
+
+/*
+ * Aborts any job in flight and joins the thread. The worker's errlist is left
+ * for the caller to report and free.
+ */
+void stop_worker(struct mu_worker *worker)
+{
+	if (!worker->started)
+		return;
+
+	pthread_mutex_lock(&worker->lock);
+	worker->quit = true;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_join(worker->thread, NULL);
+
+	for (size_t i = 0; i < worker->nresults; i++)
+		release_buffer(worker->pool, worker->results[i].image);
+	worker->nresults = 0;
+
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+	worker->started = false;
+}
+
+// Replaces whatever preview job is queued or running with this one
+void submit_job(struct mu_worker *worker, struct mu_job *job)
+{
+	pthread_mutex_lock(&worker->lock);
+	worker->job = *job;
+	worker->job.kind = MU_JOB_PREVIEW;
+	worker->job.generation = ++worker->generation;
+	worker->pending = true;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+// Drops the queued preview job and ignores the one running, if any
+void cancel_job(struct mu_worker *worker)
+{
+	pthread_mutex_lock(&worker->lock);
+	worker->generation++;
+	worker->pending = false;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/*
+ * Replaces the queued tile jobs. The tile being rendered still completes and
+ * is not queued a second time.
+ */
+void submit_tiles(struct mu_worker *worker, struct mu_job *jobs, size_t njobs)
+{
+	if (njobs > MU_WORKER_QUEUE)
+		njobs = MU_WORKER_QUEUE;
+
+	pthread_mutex_lock(&worker->lock);
+	worker->ntiles = 0;
+	for (size_t i = 0; i < njobs; i++) {
+		if (worker->running_tile && tile_key_equal(&worker->running, &jobs[i].key))
+			continue;
+		worker->tiles[worker->ntiles] = jobs[i];
+		worker->tiles[worker->ntiles++].kind = MU_JOB_TILE;
+	}
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+bool take_result(struct mu_worker *worker, struct mu_result *res)
+{
+	bool ready;
+
+	pthread_mutex_lock(&worker->lock);
+	ready = worker->nresults > 0;
+	if (ready) {
+		*res = worker->results[0];
+		memmove(worker->results, worker->results + 1, --worker->nresults * sizeof(struct mu_result));
+		pthread_cond_signal(&worker->cond);
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return ready;
+}
@@ -0,0 +1,109 @@
+#ifndef MU_WORKER_H
+#define MU_WORKER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <MagickWand/MagickWand.h>
+
+#include "loop.h"
+#include "pool.h"
+#include "pyramid.h"
+#include "tiles.h"
+#include "util/error.h"
+
+// Queue depth for tile jobs
+#define MU_WORKER_QUEUE 64
+/*
+ * Finished results, bounded so that the job being rendered, the result being
+ * shown and a prefetch (two buffers each for rendering) still get a buffer
+ */
+#define MU_WORKER_RESULTS (MU_POOL_BUFFERS - 5)
+
+enum mu_job_kind {
+	MU_JOB_PREVIEW,
+	MU_JOB_TILE
+};
+
+enum mu_quality {
+	MU_QUALITY_FAST,
+	MU_QUALITY_FINAL
+};
+
+/*
+ * A preview request: the x/y/s_width/s_height region of the master resampled
+ * to width x height, either point sampled (fast) or area averaged (final).
+ * Tile jobs render one cache tile, identified by key.
+ */
+struct mu_job {
+	enum mu_job_kind kind;
+	struct mu_tile_key key;
+
+	size_t x;
+	size_t y;
+	size_t s_width;
+	size_t s_height;
+
+	size_t width;
+	size_t height;
+
+	enum mu_quality quality;
+	unsigned long generation;
+};
+
+struct mu_result {
+	struct mu_job job;
+
+	unsigned char *image;
+	size_t length;
+	int ret;
+};
+
+/*
+ * Renders previews and zoom tiles off the UI thread. Only the newest preview
+ * job is kept; older ones are dropped before they start and aborted while
+ * running, during the master's decode and between bands of the export and
+ * resample. Previews go before tiles, and each submit_tiles() replaces the
+ * tiles still queued. Finished results are queued for take_result() and wake
+ * the main loop.
+ */
+struct mu_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct mu_pyramid *pyramid;
+	struct mu_pool *pool;
+	struct mu_loop *loop;
+	struct mu_error *errlist;
+
+	struct mu_job job;
+	unsigned long generation;
+	unsigned long rendering;
+	bool pending;
+
+	struct mu_job tiles[MU_WORKER_QUEUE];
+	size_t ntiles;
+	struct mu_tile_key running;
+	bool running_tile;
+
+	struct mu_result results[MU_WORKER_RESULTS];
+	size_t nresults;
+
+	bool started;
+	bool quit;
+};
+
+extern int render_job(struct mu_error **err, struct mu_pyramid *pyr, struct mu_pool *pool, struct mu_job *job,
+		struct mu_result *res, MagickProgressMonitor monitor, void *data);
+
+extern int start_worker(struct mu_error **err, struct mu_worker *worker, struct mu_pyramid *pyr, struct mu_pool *pool,
+		struct mu_loop *loop);
+extern void stop_worker(struct mu_worker *worker);
+
+extern void submit_job(struct mu_worker *worker, struct mu_job *job);
+extern void cancel_job(struct mu_worker *worker);
+extern void submit_tiles(struct mu_worker *worker, struct mu_job *jobs, size_t njobs);
+extern bool take_result(struct mu_worker *worker, struct mu_result *res);
+
+#endif